@@ -1,4 +1,5 @@
 #include "common.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,6 +45,9 @@ static int err_reenter = 0;
 // Global variable to track the last opened TIFF handle
 TIFF *last_tiff = NULL;
 
+bool tiff_errors_deferred = false;
+int tiff_error_count = 0;
+
 static char txtbuf[2048];  // text buffer
 
 // avoid protection issues with setAttrib
@@ -74,6 +78,10 @@ static void TIFFWarningHandler_(const char* module, const char* fmt,
 }
 
 static void TIFFErrorHandler_(const char* module, const char* fmt, va_list ap) {
+  if (tiff_errors_deferred) {
+    tiff_error_count++;
+    return;
+  }
   if (err_reenter) return;
   /* prevent re-entrance which can happen as TIFF
      is happy to call another error from Close */
@@ -122,7 +130,14 @@ void cleanup_tiff_ptr(SEXP ptr) {
 static tsize_t TIFFReadProc_(thandle_t usr, tdata_t buf, tsize_t length) {
   tiff_job_t *rj = (tiff_job_t*) usr;  // rj is read_job
   tsize_t to_read = length;
-  if (rj->f) return fread(buf, 1, to_read, rj->f);
+  if (rj->f) {
+    trace_span_t span = trace_begin();
+    tsize_t got = fread(buf, 1, to_read, rj->f);
+    trace_end(TRACE_IO, span);
+    trace_count(TRACE_READS, 1);
+    trace_count(TRACE_BYTES_READ, got);
+    return got;
+  }
   #if TIFF_DEBUG
     Rprintf("read [@%d %d/%d] -> %d\n", rj->ptr, rj->len, rj->alloc, length);
   #endif
@@ -165,6 +180,7 @@ static tsize_t TIFFWriteProc_(thandle_t usr, tdata_t buf, tsize_t length) {
 static toff_t  TIFFSeekProc_(thandle_t usr, toff_t offset, int whence) {
   tiff_job_t *rj = (tiff_job_t*) usr;
   if (rj->f) {
+    trace_count(TRACE_SEEKS, 1);
   	int e = fseeko(rj->f, offset, whence);
 	  if (e != 0) {
 	    Rf_warning("fseek failed on a file in TIFFSeekProc");
@@ -255,10 +271,11 @@ TIFF *TIFF_Open(const char *mode, tiff_job_t *rj) {
     size_t read = fread(magic, 1, 4, rj->f);
     fseek(rj->f, pos, SEEK_SET); // Reset file position
     
-    // Check TIFF signature: II (Intel) or MM (Motorola) followed by version (usually 42)
+    // Check TIFF signature: II (Intel) or MM (Motorola) followed by version
+    // (42, or 43 for BigTIFF)
     if (read != 4 || 
-        !((magic[0] == 'I' && magic[1] == 'I' && magic[2] == 42 && magic[3] == 0) || 
-          (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && magic[3] == 42))) {
+        !((magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) && magic[3] == 0) || 
+          (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43)))) {
       // Not a valid TIFF file, don't even try TIFFClientOpen
       return NULL;
     }
@@ -277,6 +294,8 @@ TIFF *TIFF_Open(const char *mode, tiff_job_t *rj) {
 
 // Helper function to open a TIFF file
 TIFF* open_tiff_file(const char* filename, tiff_job_t* rj, FILE** f) {
+    trace_span_t span = trace_begin();
+    trace_count(TRACE_OPENS, 1);
     *f = fopen(filename, "rb");
     if (!*f) {
         Rf_error("Unable to open %s", filename);
@@ -289,6 +308,7 @@ TIFF* open_tiff_file(const char* filename, tiff_job_t* rj, FILE** f) {
         rj->f = NULL;
         Rf_error("Unable to open as TIFF file: %s does not appear to be a valid TIFF file", filename);
     }
+    trace_end(TRACE_OPEN, span);
     return tiff;
 }
 
@@ -38,4 +38,10 @@ extern const size_t n_supported_tags;
 // Global variable to track the last opened TIFF handle for cleanup
 extern TIFF *last_tiff;
 
+// While set, libtiff errors are counted in `tiff_error_count` instead of
+// being raised as R errors, so that the caller can check libtiff's return
+// values and carry on
+extern bool tiff_errors_deferred;
+extern int tiff_error_count;
+
 #endif  // PKG_TIFF_COMMON_H__
@@ -0,0 +1,554 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "half.h"
+#include "trace.h"
+
+#include <R.h>
+#include <Rinternals.h>
+
+// Readahead needs POSIX threads and pread(), and TIFFReadFromUserBuffer()
+// (libtiff 4.1.0) to decode strips/tiles that someone else has read
+#if !defined(_WIN32) && defined(TIFFLIB_VERSION) && TIFFLIB_VERSION >= 20191103
+#define IJTIFF_READAHEAD 1
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define IJTIFF_READAHEAD 0
+#endif
+
+void get_frame_info(TIFF *tiff, frame_info_t *info) {
+    memset(info, 0, sizeof(frame_info_t));
+    info->bps = 8;
+    info->spp = 1;
+    info->sformat = SAMPLEFORMAT_UINT;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &info->width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &info->length);
+    if (!TIFFGetField(tiff, TIFFTAG_IMAGEDEPTH, &info->depth)) info->depth = 0;
+    if (TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &info->tile_width)) {
+        TIFFGetField(tiff, TIFFTAG_TILELENGTH, &info->tile_length);
+    } else {  // no tiles
+        info->tile_width = info->tile_length = 0;
+    }
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &info->rows_per_strip);
+    if (info->rows_per_strip == 0 || info->rows_per_strip > info->length) {
+        info->rows_per_strip = info->length;
+    }
+    TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &info->config);
+    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &info->bps);
+    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &info->spp);
+    info->out_spp = info->spp;
+    TIFFGetField(tiff, TIFFTAG_COLORMAP,
+                 info->colormap, info->colormap + 1, info->colormap + 2);
+    if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &info->sformat) &&
+        info->sformat == SAMPLEFORMAT_IEEEFP) {
+        info->is_float = true;
+    }
+    if (info->spp == 1) { /* modify out_spp for colormaps */
+        if (info->colormap[2]) {
+            info->out_spp = 3;
+        } else if (info->colormap[1]) {
+            info->out_spp = 2;
+        }
+    }
+    #if TIFF_DEBUG
+        Rprintf("image %d x %d x %d, tiles %d x %d, bps = %d, spp = %d (output %d), "
+                "config = %d, colormap = %s\n",
+                info->width, info->length, info->depth, info->tile_width,
+                info->tile_length, info->bps, info->spp, info->out_spp,
+                info->config, info->colormap[0] ? "yes" : "no");
+    #endif
+}
+
+void drop_colormap(frame_info_t *info) {
+    info->colormap[0] = info->colormap[1] = info->colormap[2] = NULL;
+    info->out_spp = info->spp;
+}
+
+const char *frame_info_problem(const frame_info_t *info, char *msg, size_t len) {
+    uint16_t bps = info->bps;
+    if (info->is_float) {
+        if (bps != 16 && bps != 32 && bps != 64) {
+            snprintf(msg, len, "%d-bit floating point images are not "
+                     "supported", bps);
+            return msg;
+        }
+    } else if (bps != 1 && bps != 2 && bps != 4 && bps != 8 && bps != 12 &&
+               bps != 16 && bps != 24 && bps != 32) {
+        snprintf(msg, len, "image has %d bits/sample which is unsupported",
+                 bps);
+        return msg;
+    }
+    if (info->tile_width && info->spp > 1 &&
+        info->config != PLANARCONFIG_CONTIG) {
+        snprintf(msg, len, "Planar format tiled images are not supported");
+        return msg;
+    }
+    return NULL;
+}
+
+static void *scratch_reserve(void *cur, size_t *cur_size, size_t size) {
+    if (cur && *cur_size >= size) return cur;
+    void *out = realloc(cur, size);
+    if (!out) Rf_error("cannot allocate decode buffer of %zu bytes", size);
+    *cur_size = size;
+    return out;
+}
+
+static void free_readahead(struct readahead *ra);
+
+void free_scratch(decode_scratch_t *scratch) {
+    free(scratch->buf);
+    free(scratch->row);
+    free_readahead(scratch->ra);
+    memset(scratch, 0, sizeof(decode_scratch_t));
+}
+
+// Unpack `n` samples of `bps` (1, 2 or 4) bits, packed most significant bits
+// first from the start of `src`, a whole byte at a time
+static void unpack_sub_byte(const uint8_t *src, double *dst, size_t n,
+                            unsigned bps) {
+    unsigned per_byte = 8 / bps, mask = (1u << bps) - 1;
+    size_t i = 0;
+    for (; i + per_byte <= n; i += per_byte) {
+        unsigned b = *src++;
+        for (unsigned k = 0; k < per_byte; k++)
+            dst[i + k] = (b >> (8 - bps * (k + 1))) & mask;
+    }
+    for (unsigned k = 0; i < n; i++, k++)
+        dst[i] = (*src >> (8 - bps * (k + 1))) & mask;
+}
+
+// Unpack `n` 12-bit samples, packed big-end first: each 3 bytes hold 2
+static void unpack_12(const uint8_t *src, double *dst, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2, src += 3) {
+        dst[i] = (src[0] << 4) | (src[1] >> 4);
+        dst[i + 1] = ((src[1] & 0x0f) << 8) | src[2];
+    }
+    if (i < n) dst[i] = (src[0] << 4) | (src[1] >> 4);
+}
+
+// Unpack `n` 24-bit samples, which libtiff leaves in the machine's byte order
+static void unpack_24(const uint8_t *src, double *dst, size_t n) {
+    for (size_t i = 0; i < n; i++, src += 3) {
+#ifdef WORDS_BIGENDIAN
+        dst[i] = ((uint32_t)src[0] << 16) | (src[1] << 8) | src[2];
+#else
+        dst[i] = ((uint32_t)src[2] << 16) | (src[1] << 8) | src[0];
+#endif
+    }
+}
+
+// Convert `n` raw samples of `bps` bits and sample format `sformat` to
+// doubles. Samples of fewer than 8 bits and 12-bit samples are packed.
+static void convert_samples(const uint8_t *src, double *dst, size_t n,
+                            uint16_t bps, uint16_t sformat) {
+    size_t i;
+    bool is_float = sformat == SAMPLEFORMAT_IEEEFP;
+    bool is_signed = sformat == SAMPLEFORMAT_INT;
+    if (bps == 8) {
+        if (is_signed) {
+            const int8_t *v = (const int8_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        } else {
+            for (i = 0; i < n; i++) dst[i] = (double)src[i];
+        }
+    } else if (bps == 16) {
+        if (is_float) {
+            const uint16_t *v = (const uint16_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)half_to_float(v[i]);
+        } else if (is_signed) {
+            const int16_t *v = (const int16_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        } else {
+            const uint16_t *v = (const uint16_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        }
+    } else if (bps == 32) {
+        if (is_float) {
+            const float *v = (const float*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        } else if (is_signed) {
+            const int32_t *v = (const int32_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        } else {
+            const uint32_t *v = (const uint32_t*)src;
+            for (i = 0; i < n; i++) dst[i] = (double)v[i];
+        }
+    } else if (bps == 64 && is_float) {
+        memcpy(dst, src, n * sizeof(double));
+    } else if (bps < 8 || bps == 12 || bps == 24) {
+        if (bps == 12) {
+            unpack_12(src, dst, n);
+        } else if (bps == 24) {
+            unpack_24(src, dst, n);
+        } else {
+            unpack_sub_byte(src, dst, n, bps);
+        }
+        if (is_signed) {  // two's complement
+            double half = ldexp(1, bps - 1), full = ldexp(1, bps);
+            for (i = 0; i < n; i++) if (dst[i] >= half) dst[i] -= full;
+        }
+    } else {
+        for (i = 0; i < n; i++) dst[i] = NA_REAL;
+    }
+}
+
+// Convert one run of pixels and pass it on, expanding colormap indices
+static void emit_row(const frame_info_t *info, decode_scratch_t *scratch,
+                     row_visitor_t visit, void *ctx, uint32_t y, uint32_t x0,
+                     uint32_t n, uint16_t s0, uint16_t ns, const uint8_t *src) {
+    double *vals = scratch->row;
+    convert_samples(src, vals, (size_t)n * ns, info->bps, info->sformat);
+    if (info->spp == 1 && info->colormap[0]) {
+        // color maps are always 16-bit
+        double *rgb = vals + n;
+        uint16_t k, out_spp = info->out_spp;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t ci = (uint32_t)vals[i];
+            for (k = 0; k < out_spp; k++) {
+                rgb[(size_t)i * out_spp + k] = (double)info->colormap[k][ci];
+            }
+        }
+        visit(ctx, y, x0, n, 0, out_spp, rgb);
+    } else {
+        visit(ctx, y, x0, n, s0, ns, vals);
+    }
+}
+
+// Where the decoded bytes of each strip/tile of a directory go
+typedef struct strile_layout {
+    bool tiled, separate;
+    uint16_t ns;  // samples per pixel in each strip/tile
+    size_t row_bytes;  // bytes in one row of a strip/tile
+    uint32_t strips_per_plane;  // stripped images
+    uint32_t tiles_across;  // tiled images
+    uint32_t n;  // the number of strips/tiles to decode
+} strile_layout_t;
+
+// Pass on the rows of strip/tile `i`, whose `n` decoded bytes are in
+// `scratch->buf`. Returns false if there's nothing more to decode.
+static bool emit_strile(const frame_info_t *info, decode_scratch_t *scratch,
+                        const strile_layout_t *lay, row_visitor_t visit,
+                        void *ctx, uint32_t i, tsize_t n) {
+    const uint8_t *buf = (const uint8_t*)scratch->buf;
+    uint32_t r;
+    trace_span_t span = trace_begin();
+    if (!lay->tiled) {
+        uint16_t plane = lay->separate ? i / lay->strips_per_plane : 0;
+        uint32_t y0 = (i % lay->strips_per_plane) * info->rows_per_strip;
+        uint32_t rows = n / lay->row_bytes;
+        if (plane >= info->spp) return false;
+        for (r = 0; r < rows && y0 + r < info->length; r++) {
+            emit_row(info, scratch, visit, ctx, y0 + r, 0, info->width,
+                     plane, lay->ns, buf + r * lay->row_bytes);
+        }
+    } else {
+        uint32_t x = (i % lay->tiles_across) * info->tile_width;
+        uint32_t y = (i / lay->tiles_across) * info->tile_length;
+        uint32_t cols = info->width - x;
+        if (cols > info->tile_width) cols = info->tile_width;
+        for (r = 0; r < info->tile_length && y + r < info->length &&
+             (tsize_t)((r + 1) * lay->row_bytes) <= n; r++) {
+            emit_row(info, scratch, visit, ctx, y + r, x, cols,
+                     0, info->spp, buf + r * lay->row_bytes);
+        }
+    }
+    trace_end(TRACE_CONVERT, span);
+    return true;
+}
+
+// Read and decode strip/tile `i` the ordinary way
+static tsize_t read_strile(TIFF *tiff, const strile_layout_t *lay,
+                           decode_scratch_t *scratch, uint32_t i) {
+    trace_span_t span = trace_begin();
+    tsize_t n = lay->tiled ?
+        TIFFReadEncodedTile(tiff, i, scratch->buf, (tsize_t) -1) :
+        TIFFReadEncodedStrip(tiff, i, scratch->buf, (tsize_t) -1);
+    trace_end(TRACE_DECODE, span);
+    trace_count(lay->tiled ? TRACE_TILES : TRACE_STRIPS, 1);
+    return n;
+}
+
+#if IJTIFF_READAHEAD
+
+// A ring of `depth` buffers that a background thread fills with the
+// compressed bytes of strips/tiles 0 to `n - 1`, in order, reading ahead of
+// the main thread, which decodes them. The background thread only ever calls
+// pread(): libtiff and R are left to the main thread.
+struct readahead {
+    int depth;
+    uint8_t **bufs;
+    size_t *caps;
+    tmsize_t *got;  // bytes read into each buffer, -1 on failure
+    uint64_t *offsets, *counts;  // of each strip/tile
+    uint32_t n_cap;
+    uint32_t n, produced, consumed;
+    bool stop;
+    int fd;
+    // the background thread's I/O, added to the trace when it's done
+    bool timed;
+    uint64_t reads, bytes_read, io_ns;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+static void free_readahead(struct readahead *ra) {
+    if (!ra) return;
+    for (int k = 0; k < ra->depth; k++) free(ra->bufs[k]);
+    free(ra->bufs);
+    free(ra->caps);
+    free(ra->got);
+    free(ra->offsets);
+    free(ra->counts);
+    pthread_mutex_destroy(&ra->mutex);
+    pthread_cond_destroy(&ra->cond);
+    free(ra);
+}
+
+// Get a ring of `depth` buffers with room for the offsets of `n` strips/tiles,
+// reusing the scratch one if possible. NULL if memory runs out.
+static struct readahead *reserve_readahead(decode_scratch_t *scratch,
+                                           int depth, uint32_t n) {
+    struct readahead *ra = scratch->ra;
+    if (ra && ra->depth != depth) {
+        free_readahead(ra);
+        ra = scratch->ra = NULL;
+    }
+    if (!ra) {
+        ra = calloc(1, sizeof(struct readahead));
+        if (!ra) return NULL;
+        pthread_mutex_init(&ra->mutex, NULL);
+        pthread_cond_init(&ra->cond, NULL);
+        ra->bufs = calloc(depth, sizeof(uint8_t*));
+        ra->caps = calloc(depth, sizeof(size_t));
+        ra->got = calloc(depth, sizeof(tmsize_t));
+        scratch->ra = ra;
+        if (!ra->bufs || !ra->caps || !ra->got) return NULL;
+        ra->depth = depth;
+    }
+    if (ra->n_cap < n) {
+        uint64_t *offsets = realloc(ra->offsets, n * sizeof(uint64_t));
+        if (offsets) ra->offsets = offsets;
+        uint64_t *counts = realloc(ra->counts, n * sizeof(uint64_t));
+        if (counts) ra->counts = counts;
+        if (!offsets || !counts) return NULL;
+        ra->n_cap = n;
+    }
+    return ra;
+}
+
+// pread() all `count` bytes at `offset`. Returns the number of bytes read, -1
+// on failure.
+static tmsize_t pread_all(int fd, uint8_t *buf, uint64_t count,
+                          uint64_t offset) {
+    uint64_t done = 0;
+    while (done < count) {
+        ssize_t got = pread(fd, buf + done, count - done, (off_t)(offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        done += got;
+    }
+    return (tmsize_t)done;
+}
+
+static void *readahead_thread(void *arg) {
+    struct readahead *ra = (struct readahead*) arg;
+    for (uint32_t i = 0; i < ra->n; i++) {
+        pthread_mutex_lock(&ra->mutex);
+        while (!ra->stop && ra->produced - ra->consumed >= (uint32_t)ra->depth)
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        bool stop = ra->stop;
+        pthread_mutex_unlock(&ra->mutex);
+        if (stop) break;
+        int slot = i % ra->depth;
+        uint64_t start = ra->timed ? trace_clock_ns() : 0;
+        tmsize_t got = pread_all(ra->fd, ra->bufs[slot], ra->counts[i],
+                                 ra->offsets[i]);
+        if (ra->timed) ra->io_ns += trace_clock_ns() - start;
+        ra->reads++;
+        if (got > 0) ra->bytes_read += got;
+        pthread_mutex_lock(&ra->mutex);
+        ra->got[slot] = got;
+        ra->produced++;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+    }
+    return NULL;
+}
+
+typedef struct readahead_job {
+    TIFF *tiff;
+    const frame_info_t *info;
+    decode_scratch_t *scratch;
+    const strile_layout_t *lay;
+    row_visitor_t visit;
+    void *ctx;
+} readahead_job_t;
+
+// The number of bytes that strip/tile `i` decodes to
+static tmsize_t strile_decoded_size(TIFF *tiff, const frame_info_t *info,
+                                    const strile_layout_t *lay, uint32_t i) {
+    if (lay->tiled) return TIFFTileSize(tiff);
+    uint32_t y0 = (i % lay->strips_per_plane) * info->rows_per_strip;
+    uint32_t rows = info->length - y0;
+    if (rows > info->rows_per_strip) rows = info->rows_per_strip;
+    return TIFFVStripSize(tiff, rows);
+}
+
+// Decode the strips/tiles as the background thread delivers them. Any
+// strip/tile that it couldn't read is read (or reported broken) by libtiff.
+static SEXP readahead_consume(void *data) {
+    readahead_job_t *job = (readahead_job_t*) data;
+    struct readahead *ra = job->scratch->ra;
+    for (uint32_t i = 0; i < ra->n; i++) {
+        pthread_mutex_lock(&ra->mutex);
+        while (ra->produced <= i) pthread_cond_wait(&ra->cond, &ra->mutex);
+        pthread_mutex_unlock(&ra->mutex);
+        int slot = i % ra->depth;
+        tsize_t n = -1;
+        if (ra->counts[i] && ra->got[slot] == (tmsize_t)ra->counts[i]) {
+            tmsize_t size = strile_decoded_size(job->tiff, job->info,
+                                                job->lay, i);
+            trace_span_t span = trace_begin();
+            if (TIFFReadFromUserBuffer(job->tiff, i, ra->bufs[slot],
+                                       ra->got[slot], job->scratch->buf,
+                                       size)) {
+                n = size;
+            }
+            trace_end(TRACE_DECODE, span);
+            trace_count(job->lay->tiled ? TRACE_TILES : TRACE_STRIPS, 1);
+        } else if (ra->counts[i]) {
+            n = read_strile(job->tiff, job->lay, job->scratch, i);
+        }
+        bool more = n <= 0 || emit_strile(job->info, job->scratch, job->lay,
+                                          job->visit, job->ctx, i, n);
+        pthread_mutex_lock(&ra->mutex);
+        ra->consumed++;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+        if (!more) break;
+    }
+    return R_NilValue;
+}
+
+// Stop the background thread, whether decoding finished or was interrupted
+// by an R error
+static void readahead_stop(void *data, Rboolean jump) {
+    struct readahead *ra = (struct readahead*) data;
+    pthread_mutex_lock(&ra->mutex);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    pthread_join(ra->thread, NULL);
+    // overlapped with decoding, so not part of the main thread's total
+    trace_count(TRACE_READS, ra->reads);
+    trace_count(TRACE_BYTES_READ, ra->bytes_read);
+    if (trace_on) trace_ns[TRACE_IO] += ra->io_ns;
+}
+
+// Decode the strips/tiles of the current directory with a readahead thread.
+// Returns false (having decoded nothing) if that isn't possible.
+static bool decode_readahead(TIFF *tiff, const frame_info_t *info,
+                             decode_scratch_t *scratch,
+                             const strile_layout_t *lay, row_visitor_t visit,
+                             void *ctx) {
+    if (!scratch->file || lay->n < 2) return false;
+    struct readahead *ra = reserve_readahead(scratch, scratch->readahead,
+                                             lay->n);
+    if (!ra) return false;
+    uint64_t max_count = 0;
+    for (uint32_t i = 0; i < lay->n; i++) {
+        ra->offsets[i] = TIFFGetStrileOffset(tiff, i);
+        ra->counts[i] = TIFFGetStrileByteCount(tiff, i);
+        if (ra->counts[i] > max_count) max_count = ra->counts[i];
+    }
+    if (max_count > SIZE_MAX) return false;
+    for (int k = 0; k < ra->depth; k++) {
+        if (ra->caps[k] >= max_count) continue;
+        uint8_t *buf = realloc(ra->bufs[k], max_count);
+        if (!buf) return false;
+        ra->bufs[k] = buf;
+        ra->caps[k] = max_count;
+    }
+    ra->fd = fileno(scratch->file);
+    ra->n = lay->n;
+    ra->produced = ra->consumed = 0;
+    ra->stop = false;
+    ra->timed = trace_on;
+    ra->reads = ra->bytes_read = ra->io_ns = 0;
+    if (pthread_create(&ra->thread, NULL, readahead_thread, ra)) return false;
+    readahead_job_t job = {tiff, info, scratch, lay, visit, ctx};
+    SEXP cont = PROTECT(R_MakeUnwindCont());
+    R_UnwindProtect(readahead_consume, &job, readahead_stop, ra, cont);
+    UNPROTECT(1);
+    return true;
+}
+
+#else  // no readahead: always decode the ordinary way
+
+static void free_readahead(struct readahead *ra) {}
+
+static bool decode_readahead(TIFF *tiff, const frame_info_t *info,
+                             decode_scratch_t *scratch,
+                             const strile_layout_t *lay, row_visitor_t visit,
+                             void *ctx) {
+    return false;
+}
+
+#endif  // IJTIFF_READAHEAD
+
+void decode_frame(TIFF *tiff, const frame_info_t *info,
+                  decode_scratch_t *scratch, row_visitor_t visit, void *ctx) {
+    size_t run_width = info->tile_width ? info->tile_width : info->width;
+    // room for the converted samples plus their colormap expansion
+    scratch->row = scratch_reserve(
+        scratch->row, &scratch->row_size,
+        run_width * (info->spp + info->out_spp) * sizeof(double)
+    );
+    strile_layout_t lay = {0};
+    if (info->tile_width == 0) {
+        lay.separate = info->spp > 1 && info->config != PLANARCONFIG_CONTIG;
+        lay.ns = lay.separate ? 1 : info->spp;
+        // rows of packed samples start on a byte boundary
+        lay.row_bytes = ((size_t)info->width * lay.ns * info->bps + 7) / 8;
+        lay.strips_per_plane = info->rows_per_strip ?
+            (info->length + info->rows_per_strip - 1) / info->rows_per_strip : 0;
+        lay.n = TIFFNumberOfStrips(tiff);
+        scratch->buf = scratch_reserve(scratch->buf, &scratch->buf_size,
+                                       TIFFStripSize(tiff));
+        #if TIFF_DEBUG
+            Rprintf(" - %d x %d strips\n", lay.n, TIFFStripSize(tiff));
+        #endif
+        if (lay.row_bytes == 0 || lay.strips_per_plane == 0) return;
+    } else {  // tiled image
+        lay.tiled = true;
+        lay.ns = info->spp;
+        lay.row_bytes =
+            ((size_t)info->tile_width * info->spp * info->bps + 7) / 8;
+        if (info->tile_length == 0) return;
+        lay.tiles_across = (info->width + info->tile_width - 1) / info->tile_width;
+        lay.n = lay.tiles_across *
+            ((info->length + info->tile_length - 1) / info->tile_length);
+        scratch->buf = scratch_reserve(scratch->buf, &scratch->buf_size,
+                                       TIFFTileSize(tiff));
+        #if TIFF_DEBUG
+            Rprintf(" - %d x %d tiles\n", TIFFNumberOfTiles(tiff), TIFFTileSize(tiff));
+        #endif
+    }
+    if (scratch->readahead > 0 &&
+        decode_readahead(tiff, info, scratch, &lay, visit, ctx)) {
+        return;
+    }
+    for (uint32_t i = 0; i < lay.n; i++) {
+        tsize_t n = read_strile(tiff, &lay, scratch, i);
+        if (n <= 0) continue;
+        if (!emit_strile(info, scratch, &lay, visit, ctx, i, n)) break;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef IJTIFF_DECODE_H
+#define IJTIFF_DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common.h"
+
+// Layout and sample format of the current TIFF directory
+typedef struct frame_info {
+    uint32_t width, length, depth;
+    uint32_t tile_width, tile_length;  // both 0 for stripped images
+    uint32_t rows_per_strip;
+    uint16_t config, bps, spp, sformat;
+    uint16_t out_spp;  // spp after colormap expansion
+    uint16_t *colormap[3];
+    bool is_float;
+} frame_info_t;
+
+struct readahead;
+
+// Buffers reused across strips, tiles and directories while decoding
+typedef struct decode_scratch {
+    tdata_t buf;  // raw strip/tile bytes
+    size_t buf_size;
+    double *row;  // converted samples for one run of pixels
+    size_t row_size;  // in doubles
+    // With `readahead` > 0 and `file` open, a background thread reads the
+    // compressed bytes of up to `readahead` strips/tiles ahead of decoding
+    FILE *file;
+    int readahead;
+    struct readahead *ra;  // its ring of buffers, kept for the next frame
+} decode_scratch_t;
+
+// Receives each decoded run of `n` pixels starting at (`x0`, `y`). `vals` holds
+// `n * ns` values, pixel-major, for output samples `s0` to `s0 + ns - 1`.
+typedef void (*row_visitor_t)(void *ctx, uint32_t y, uint32_t x0, uint32_t n,
+                              uint16_t s0, uint16_t ns, const double *vals);
+
+// Fill `info` from the current directory of `tiff`
+void get_frame_info(TIFF *tiff, frame_info_t *info);
+
+// Treat a colormapped image as its raw index plane
+void drop_colormap(frame_info_t *info);
+
+// Returns NULL if the directory can be decoded, otherwise an error message
+const char *frame_info_problem(const frame_info_t *info, char *msg, size_t len);
+
+// Decode every strip/tile of the current directory, handing rows to `visit`.
+// Scratch buffers are grown as needed and kept for the next call.
+void decode_frame(TIFF *tiff, const frame_info_t *info,
+                  decode_scratch_t *scratch, row_visitor_t visit, void *ctx);
+
+void free_scratch(decode_scratch_t *scratch);
+
+#endif // IJTIFF_DECODE_H
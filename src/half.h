@@ -0,0 +1,54 @@
+#ifndef IJTIFF_HALF_H
+#define IJTIFF_HALF_H
+
+#include <stdint.h>
+
+// IEEE 754 half precision (16-bit) floats, as stored in TIFFs with 16 bits
+// per sample and SAMPLEFORMAT_IEEEFP. The conversions work on the bits of
+// single precision floats, with no tables and hardly any branches, so that
+// loops of them vectorise.
+
+typedef union float_bits {
+    uint32_t u;
+    float f;
+} float_bits_t;
+
+// Exact: every half is a float
+static inline float half_to_float(uint16_t h) {
+    const float_bits_t magic = {(254u - 15u) << 23};  // 2^112
+    const float_bits_t was_inf_nan = {(127u + 16u) << 23};  // 2^16
+    float_bits_t out;
+    out.u = (uint32_t)(h & 0x7fff) << 13;  // exponent and mantissa
+    out.f *= magic.f;  // rebias the exponent, normalising subnormals
+    if (out.f >= was_inf_nan.f) out.u |= 255u << 23;  // keep Inf and NaN
+    out.u |= (uint32_t)(h & 0x8000) << 16;  // sign
+    return out.f;
+}
+
+// Rounds to nearest, ties to even. Values too big for a half become Inf and
+// NaNs stay NaN.
+static inline uint16_t float_to_half(float x) {
+    const float_bits_t f32_inf = {255u << 23};
+    const float_bits_t f16_max = {(127u + 16u) << 23};  // 2^16
+    // adding this aligns a subnormal half's mantissa at the bottom of a float
+    const float_bits_t denorm_magic = {((127u - 15u) + (23u - 10u) + 1u) << 23};
+    float_bits_t f = {0};
+    f.f = x;
+    uint32_t sign = f.u & 0x80000000u;
+    uint16_t out;
+    f.u ^= sign;
+    if (f.u >= f16_max.u) {
+        out = (f.u > f32_inf.u) ? 0x7e00 : 0x7c00;
+    } else if (f.u < (113u << 23)) {  // a subnormal half or zero
+        f.f += denorm_magic.f;
+        out = (uint16_t)(f.u - denorm_magic.u);
+    } else {
+        uint32_t mant_odd = (f.u >> 13) & 1;
+        f.u -= (127u - 15u) << 23;  // rebias the exponent
+        f.u += 0xfff + mant_odd;  // round
+        out = (uint16_t)(f.u >> 13);
+    }
+    return out | (uint16_t)(sign >> 16);
+}
+
+#endif // IJTIFF_HALF_H
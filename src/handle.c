@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle.h"
+#include "trace.h"
+
+#include <Rinternals.h>
+
+void close_handle(SEXP ptr) {
+    tif_handle_t *h = (tif_handle_t*) R_ExternalPtrAddr(ptr);
+    if (!h) return;
+    R_ClearExternalPtr(ptr);
+    if (h->tiff) {
+        TIFF *other = last_tiff;  // TIFFCloseProc_() resets last_tiff
+        TIFFClose(h->tiff);  // also closes h->rj.f
+        last_tiff = other;
+    } else if (h->rj.f) {
+        fclose(h->rj.f);
+    }
+    free_scratch(&h->scratch);
+    free(h);
+}
+
+SEXP open_handle(SEXP sFn, const char *mode) {
+    if (TYPEOF(sFn) != STRSXP || LENGTH(sFn) < 1) Rf_error("invalid filename");
+    const char *fn = CHAR(STRING_ELT(sFn, 0));
+    tif_handle_t *h = (tif_handle_t*) calloc(1, sizeof(tif_handle_t));
+    if (!h) Rf_error("cannot allocate TIFF handle");
+    SEXP ptr = PROTECT(R_MakeExternalPtr(h, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, (R_CFinalizer_t)close_handle, TRUE);
+    if (mode[0] == 'w') {
+        h->rj.f = fopen(fn, "w+b");
+        if (!h->rj.f) Rf_error("unable to create %s", fn);
+        // "w8" writes BigTIFF, for files of 4GB or more
+        h->tiff = TIFF_Open(mode[1] == '8' ? "w8m" : "wm", &h->rj);
+        if (!h->tiff) Rf_error("cannot create TIFF structure");
+    } else if (mode[0] == 'a') {  // new directories go after the last one
+        h->rj.f = fopen(fn, "r+b");
+        if (!h->rj.f) Rf_error("unable to open %s", fn);
+        h->tiff = TIFF_Open("am", &h->rj);
+        if (!h->tiff) Rf_error("unable to open %s for appending", fn);
+    } else {
+        FILE *f = NULL;
+        h->tiff = open_tiff_file(fn, &h->rj, &f);
+        h->scratch.file = f;  // for readahead
+    }
+    last_tiff = NULL;  // the handle, not TIFF_Open(), owns this TIFF
+    h->cur_dir = 1;
+    UNPROTECT(1);
+    return ptr;
+}
+
+tif_handle_t *get_handle(SEXP ptr) {
+    if (TYPEOF(ptr) != EXTPTRSXP) Rf_error("invalid TIFF handle");
+    tif_handle_t *h = (tif_handle_t*) R_ExternalPtrAddr(ptr);
+    if (!h) Rf_error("the TIFF handle has been closed");
+    return h;
+}
+
+bool handle_seek_dir(tif_handle_t *h, int dir) {
+    if (dir < 1) return false;
+    if (dir < h->cur_dir) {  // only go back to the start when necessary
+        if (!trace_set_directory(h->tiff, (tdir_t)(dir - 1))) return false;
+        h->cur_dir = dir;
+    }
+    while (h->cur_dir < dir) {
+        if (!trace_read_directory(h->tiff)) return false;
+        h->cur_dir++;
+    }
+    return true;
+}
+
+SEXP tif_open_C(SEXP sFn, SEXP sMode, SEXP sReadahead) {
+    check_type_sizes();
+    SEXP ptr = PROTECT(open_handle(sFn, CHAR(STRING_ELT(sMode, 0))));
+    get_handle(ptr)->scratch.readahead = Rf_asInteger(sReadahead);
+    UNPROTECT(1);
+    return ptr;
+}
+
+SEXP tif_close_C(SEXP ptr) {
+    close_handle(ptr);
+    return R_NilValue;
+}
@@ -0,0 +1,56 @@
+#ifndef IJTIFF_HANDLE_H
+#define IJTIFF_HANDLE_H
+
+#include <stdbool.h>
+
+#include <Rinternals.h>
+#include "common.h"
+#include "decode.h"
+
+// A TIFF file kept open across .Call()s. Unlike the `last_tiff` handles,
+// everything libtiff points at lives on the heap, so an R error can't leave
+// the handle dangling; the finalizer closes it if nobody else did.
+typedef struct tif_handle {
+    TIFF *tiff;
+    tiff_job_t rj;
+    decode_scratch_t scratch;
+    int cur_dir;  // 1-based directory that `tiff` is positioned at
+} tif_handle_t;
+
+// Open `sFn` (mode "r", "w" ("w8" for BigTIFF) or "a" to append to an
+// existing TIFF file) and
+// wrap it in an external pointer. The result needs PROTECTing.
+SEXP open_handle(SEXP sFn, const char *mode);
+
+// Get the handle behind an external pointer, erroring if it has been closed
+tif_handle_t *get_handle(SEXP ptr);
+
+// Close the file and free the buffers; safe to call more than once
+void close_handle(SEXP ptr);
+
+// Position the handle at 1-based directory `dir`. Returns false if there is
+// no such directory.
+bool handle_seek_dir(tif_handle_t *h, int dir);
+
+// How handle_read_dirs() returns colormapped directories: expanded to their
+// palette colors (as doubles), or as their palette indices
+enum { PALETTE_EXPAND = 0, PALETTE_INTEGER = 1, PALETTE_RAW = 2 };
+
+// How handle_read_dirs() shrinks each `downsample` x `downsample` block of
+// pixels: to its mean or to its top-left pixel
+enum { DOWNSAMPLE_MEAN = 0, DOWNSAMPLE_NEAREST = 1 };
+
+// Decode directories `sDirs` (sorted, 1-based) into a list of arrays. With
+// `level` > 0, the `level`th reduced-resolution SubIFD of each is decoded.
+// With `downsample` > 1, the arrays are shrunk by that factor as the rows
+// are decoded, so the full-resolution image is never held in memory.
+SEXP handle_read_dirs(SEXP ptr, SEXP sDirs, int palette, int level,
+                      int downsample, int downsample_method,
+                      bool close_on_error);
+
+SEXP tif_open_C(SEXP sFn, SEXP sMode, SEXP sReadahead);
+SEXP tif_close_C(SEXP ptr);
+SEXP tif_handle_read_C(SEXP ptr, SEXP sDirs);
+SEXP tif_handle_read_into_C(SEXP ptr, SEXP sDirs, SEXP sBuf);
+
+#endif // IJTIFF_HANDLE_H
@@ -0,0 +1,113 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+// The counts that ijtiff uses from an ImageJ ImageDescription, which is one
+// `key=value` per line after a first line of `ImageJ=<version>`. Each ImageJ
+// "image" is one TIFF directory; the channels of a slice of a frame are stored
+// one after the other, then the slices of that frame, then the next frame.
+static const char *const ij_keys[] = {"images", "channels", "slices", "frames"};
+#define N_IJ_KEYS 4
+
+static bool is_ij_description(const char *desc) {
+  return strncmp(desc, "ImageJ", 6) == 0;
+}
+
+// Index in `ij_keys` of the key of the line `line` (of length `len`), -1 if
+// it's not one of them
+static int ij_key_index(const char *line, size_t len) {
+  const char *eq = memchr(line, '=', len);
+  if (!eq) return -1;
+  size_t key_len = eq - line;
+  for (int k = 0; k < N_IJ_KEYS; k++) {
+    if (strlen(ij_keys[k]) == key_len && !strncmp(line, ij_keys[k], key_len))
+      return k;
+  }
+  return -1;
+}
+
+// Read the counts of `desc` into `counts` (NA_INTEGER where not given) in one
+// pass over its lines
+static void ij_parse(const char *desc, int *counts) {
+  for (int k = 0; k < N_IJ_KEYS; k++) counts[k] = NA_INTEGER;
+  const char *line = desc;
+  while (*line) {
+    const char *eol = strchr(line, '\n');
+    size_t len = eol ? (size_t)(eol - line) : strlen(line);
+    int k = ij_key_index(line, len);
+    if (k >= 0) {
+      const char *val = line + strlen(ij_keys[k]) + 1;
+      char *end;
+      long v = strtol(val, &end, 10);
+      if (end != val && v >= 0 && v <= INT_MAX) counts[k] = (int)v;
+    }
+    if (!eol) break;
+    line = eol + 1;
+  }
+}
+
+// The counts `c(images, channels, slices, frames)` (NA where not given) of an
+// ImageJ ImageDescription, or NULL if `sDesc` isn't one
+SEXP ij_parse_description_C(SEXP sDesc) {
+  if (TYPEOF(sDesc) != STRSXP || LENGTH(sDesc) != 1 ||
+      STRING_ELT(sDesc, 0) == NA_STRING) {
+    return R_NilValue;
+  }
+  const char *desc = CHAR(STRING_ELT(sDesc, 0));
+  if (!is_ij_description(desc)) return R_NilValue;
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, N_IJ_KEYS));
+  ij_parse(desc, INTEGER(out));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, N_IJ_KEYS));
+  for (int k = 0; k < N_IJ_KEYS; k++)
+    SET_STRING_ELT(names, k, Rf_mkChar(ij_keys[k]));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return out;
+}
+
+// Make an ImageJ ImageDescription with the counts `sCounts` (integer, in the
+// order of `ij_keys`; channels, slices and frames are left out when NA or 1).
+// The other lines of `sDesc`, if it's an ImageJ ImageDescription, are kept.
+SEXP ij_description_C(SEXP sDesc, SEXP sCounts) {
+  if (TYPEOF(sCounts) != INTSXP || LENGTH(sCounts) != N_IJ_KEYS)
+    Rf_error("`counts` must be an integer vector of length %d", N_IJ_KEYS);
+  const int *counts = INTEGER(sCounts);
+  const char *old = "";
+  if (TYPEOF(sDesc) == STRSXP && LENGTH(sDesc) == 1 &&
+      STRING_ELT(sDesc, 0) != NA_STRING &&
+      is_ij_description(CHAR(STRING_ELT(sDesc, 0)))) {
+    old = CHAR(STRING_ELT(sDesc, 0));
+  }
+  size_t cap = strlen(old) + 128;
+  char *out = (char*) R_alloc(cap, 1), *p = out;
+  // With a version number, ImageJ assumes that the frames are stored in one
+  // contiguous block and reads them all from the first directory. libtiff
+  // puts a directory after each frame, so leave it out to have ImageJ read
+  // the directories one by one.
+  p += snprintf(p, cap - (p - out), "ImageJ=\n");
+  int n_dims = 0;  // of channels, slices and frames, how many are more than 1
+  for (int k = 0; k < N_IJ_KEYS; k++) {
+    if (counts[k] == NA_INTEGER || (k && counts[k] <= 1)) continue;
+    p += snprintf(p, cap - (p - out), "%s=%d\n", ij_keys[k], counts[k]);
+    if (k) n_dims++;
+  }
+  if (n_dims > 1) p += snprintf(p, cap - (p - out), "hyperstack=true\n");
+  const char *line = strchr(old, '\n');  // skip the `ImageJ=` line
+  while (line && *++line) {
+    const char *eol = strchr(line, '\n');
+    size_t len = eol ? (size_t)(eol - line) : strlen(line);
+    if (len && ij_key_index(line, len) < 0 && strncmp(line, "hyperstack=", 11)) {
+      memcpy(p, line, len);
+      p += len;
+      *p++ = '\n';
+    }
+    line = eol;
+  }
+  *p = '\0';
+  return Rf_mkString(out);
+}
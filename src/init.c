@@ -4,34 +4,83 @@
 #include <R_ext/Rdynload.h>
 
 #include "common.h"
+#include "mmap.h"
 
 /* FIXME: 
    Check these declarations against the C/Fortran source code.
 */
 
 /* .Call calls */
+extern SEXP codec_configured_C(SEXP);
 extern SEXP count_directories_C(SEXP);
 extern SEXP dims_C(SEXP);
-extern SEXP enlist_img_C(SEXP);
 extern SEXP enlist_planes_C(SEXP);
 extern SEXP float_max_C(void);
+extern SEXP frame_range_C(SEXP);
+extern SEXP frame_stats_C(SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP get_supported_tags_C(SEXP);
+extern SEXP ij_description_C(SEXP, SEXP);
+extern SEXP ij_parse_description_C(SEXP);
 extern SEXP match_pillar_to_row_3_C(SEXP, SEXP);
+extern SEXP mmap_info_C(void);
+extern SEXP raster_C(SEXP, SEXP, SEXP, SEXP);
+extern SEXP read_ebimage_C(SEXP, SEXP, SEXP);
 extern SEXP read_tags_C(SEXP, SEXP);
-extern SEXP read_tif_C(SEXP, SEXP);
-extern SEXP write_tif_C(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP read_tif_C(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP read_tif_mmap_C(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP read_txt_img_C(SEXP);
+extern SEXP sample_compression_C(SEXP, SEXP, SEXP, SEXP);
+extern SEXP scan_img_C(SEXP);
+extern SEXP tif_close_C(SEXP);
+extern SEXP tif_handle_read_C(SEXP, SEXP);
+extern SEXP tif_handle_read_into_C(SEXP, SEXP, SEXP);
+extern SEXP tif_open_C(SEXP, SEXP, SEXP);
+extern SEXP tif_set_description_C(SEXP, SEXP);
+extern SEXP tif_transcode_C(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP trace_C(SEXP);
+extern SEXP trace_begin_C(void);
+extern SEXP trace_end_C(SEXP, SEXP);
+extern SEXP trace_stats_C(SEXP);
+extern SEXP transpose_C(SEXP, SEXP);
+extern SEXP transpose_planes_C(SEXP, SEXP, SEXP, SEXP);
+extern SEXP write_tif_C(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP write_txt_img_C(SEXP, SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
+    {"codec_configured_C",      (DL_FUNC) &codec_configured_C,      1},
     {"count_directories_C",    (DL_FUNC) &count_directories_C,    1},
     {"dims_C",                  (DL_FUNC) &dims_C,                  1},
-    {"enlist_img_C",            (DL_FUNC) &enlist_img_C,            1},
     {"enlist_planes_C",         (DL_FUNC) &enlist_planes_C,         1},
     {"float_max_C",             (DL_FUNC) &float_max_C,             0},
+    {"frame_range_C",           (DL_FUNC) &frame_range_C,           1},
+    {"frame_stats_C",           (DL_FUNC) &frame_stats_C,           5},
     {"get_supported_tags_C",    (DL_FUNC) &get_supported_tags_C,    1},
+    {"ij_description_C",        (DL_FUNC) &ij_description_C,        2},
+    {"ij_parse_description_C",  (DL_FUNC) &ij_parse_description_C,  1},
     {"match_pillar_to_row_3_C", (DL_FUNC) &match_pillar_to_row_3_C, 2},
+    {"mmap_info_C",             (DL_FUNC) &mmap_info_C,             0},
+    {"raster_C",                (DL_FUNC) &raster_C,                4},
+    {"read_ebimage_C",          (DL_FUNC) &read_ebimage_C,          3},
     {"read_tags_C",             (DL_FUNC) &read_tags_C,             2},
-    {"read_tif_C",              (DL_FUNC) &read_tif_C,              2},
-    {"write_tif_C",             (DL_FUNC) &write_tif_C,             16},
+    {"read_tif_C",              (DL_FUNC) &read_tif_C,              7},
+    {"read_tif_mmap_C",         (DL_FUNC) &read_tif_mmap_C,         8},
+    {"read_txt_img_C",          (DL_FUNC) &read_txt_img_C,          1},
+    {"sample_compression_C",    (DL_FUNC) &sample_compression_C,    4},
+    {"scan_img_C",              (DL_FUNC) &scan_img_C,              1},
+    {"tif_close_C",             (DL_FUNC) &tif_close_C,             1},
+    {"tif_handle_read_C",       (DL_FUNC) &tif_handle_read_C,       2},
+    {"tif_handle_read_into_C",  (DL_FUNC) &tif_handle_read_into_C,  3},
+    {"tif_open_C",              (DL_FUNC) &tif_open_C,              3},
+    {"tif_set_description_C",   (DL_FUNC) &tif_set_description_C,   2},
+    {"tif_transcode_C",         (DL_FUNC) &tif_transcode_C,         6},
+    {"trace_C",                 (DL_FUNC) &trace_C,                 1},
+    {"trace_begin_C",           (DL_FUNC) &trace_begin_C,           0},
+    {"trace_end_C",             (DL_FUNC) &trace_end_C,             2},
+    {"trace_stats_C",           (DL_FUNC) &trace_stats_C,           1},
+    {"transpose_C",             (DL_FUNC) &transpose_C,             2},
+    {"transpose_planes_C",      (DL_FUNC) &transpose_planes_C,      4},
+    {"write_tif_C",             (DL_FUNC) &write_tif_C,             20},
+    {"write_txt_img_C",         (DL_FUNC) &write_txt_img_C,         2},
     {NULL, NULL, 0}
 };
 
@@ -39,6 +88,7 @@ void R_init_ijtiff(DllInfo *dll)
 {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    init_mmap(dll);
     
     // Register cleanup handler to be called at exit
     R_RegisterCFinalizerEx(R_NilValue, (R_CFinalizer_t) cleanup_tiff, TRUE);
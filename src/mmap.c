@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmap.h"
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+
+#if IJTIFF_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The mapping behind an mmap vector. `data1` of the vector is an external
+// pointer to this, with the scratch directory as its tag (for duplicates),
+// and `data2` is the length as a double.
+typedef struct mmap_buf {
+    double *addr;
+    size_t bytes;
+} mmap_buf_t;
+
+static R_altrep_class_t mmap_real_class;
+
+static void mmap_finalize(SEXP eptr) {
+    mmap_buf_t *m = (mmap_buf_t*) R_ExternalPtrAddr(eptr);
+    if (!m) return;
+    if (m->bytes) munmap(m->addr, m->bytes);
+    free(m);
+    R_ClearExternalPtr(eptr);
+}
+
+SEXP mmap_real_alloc(R_xlen_t n, const char *dir) {
+    if (n == 0) return Rf_allocVector(REALSXP, 0);
+    SEXP sDir = PROTECT(Rf_mkString(dir));
+    mmap_buf_t *m = (mmap_buf_t*) calloc(1, sizeof(mmap_buf_t));
+    if (!m) Rf_error("Failed to allocate memory");
+    SEXP eptr = PROTECT(R_MakeExternalPtr(m, sDir, R_NilValue));
+    R_RegisterCFinalizerEx(eptr, mmap_finalize, TRUE);
+    m->bytes = (size_t)n * sizeof(double);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/ijtiff-mmap-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        m->bytes = 0;
+        Rf_error("Failed to create a scratch file in %s: %s", dir,
+                 strerror(errno));
+    }
+    // The file is unlinked straight away, so it goes when the mapping
+    // does, even if R crashes. Reserving its blocks up front (where the
+    // file system allows) means that running out of disk is an error
+    // here rather than a crash when a page is first written.
+    unlink(path);
+    int err = ftruncate(fd, (off_t)m->bytes) ? errno : 0;
+#ifdef __linux__
+    if (!err) err = posix_fallocate(fd, 0, (off_t)m->bytes);
+    if (err == EOPNOTSUPP || err == EINVAL) err = 0;
+#endif
+    void *addr = err ? MAP_FAILED :
+        mmap(NULL, m->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (!err && addr == MAP_FAILED) err = errno;
+    close(fd);
+    if (err) {
+        double gb = m->bytes / 1e9;
+        m->bytes = 0;
+        Rf_error("Failed to make a %.1f GB scratch file in %s: %s", gb,
+                 dir, strerror(err));
+    }
+    m->addr = (double*) addr;
+    SEXP len = PROTECT(Rf_ScalarReal((double)n));
+    SEXP out = R_new_altrep(mmap_real_class, eptr, len);
+    UNPROTECT(3);
+    return out;
+}
+
+static mmap_buf_t *get_mmap_buf(SEXP x) {
+    mmap_buf_t *m = (mmap_buf_t*) R_ExternalPtrAddr(R_altrep_data1(x));
+    if (!m) Rf_error("the memory map behind this array has been released");
+    return m;
+}
+
+static R_xlen_t mmap_length(SEXP x) {
+    return (R_xlen_t) REAL(R_altrep_data2(x))[0];
+}
+
+static Rboolean mmap_inspect(SEXP x, int pre, int deep, int pvec,
+                             void (*inspect_subtree)(SEXP, int, int, int)) {
+    Rprintf(" ijtiff memory-mapped double vector (length %.0f)\n",
+            (double)mmap_length(x));
+    return TRUE;
+}
+
+// Copies are memory-mapped too, so that modifying a huge array doesn't
+// bring all of it into memory
+static SEXP mmap_duplicate(SEXP x, Rboolean deep) {
+    SEXP dir = R_ExternalPtrTag(R_altrep_data1(x));
+    R_xlen_t n = mmap_length(x);
+    SEXP out = PROTECT(mmap_real_alloc(n, CHAR(STRING_ELT(dir, 0))));
+    memcpy(get_mmap_buf(out)->addr, get_mmap_buf(x)->addr, n * sizeof(double));
+    UNPROTECT(1);
+    return out;
+}
+
+static void *mmap_dataptr(SEXP x, Rboolean writeable) {
+    return get_mmap_buf(x)->addr;
+}
+
+static const void *mmap_dataptr_or_null(SEXP x) {
+    return mmap_dataptr(x, FALSE);
+}
+
+static double mmap_elt(SEXP x, R_xlen_t i) {
+    return get_mmap_buf(x)->addr[i];
+}
+
+static R_xlen_t mmap_get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf) {
+    R_xlen_t len = mmap_length(x);
+    if (i >= len) return 0;
+    if (n > len - i) n = len - i;
+    memcpy(buf, get_mmap_buf(x)->addr + i, n * sizeof(double));
+    return n;
+}
+
+void init_mmap(DllInfo *dll) {
+    mmap_real_class = R_make_altreal_class("mmap_real", "ijtiff", dll);
+    R_set_altrep_Length_method(mmap_real_class, mmap_length);
+    R_set_altrep_Inspect_method(mmap_real_class, mmap_inspect);
+    R_set_altrep_Duplicate_method(mmap_real_class, mmap_duplicate);
+    R_set_altvec_Dataptr_method(mmap_real_class, mmap_dataptr);
+    R_set_altvec_Dataptr_or_null_method(mmap_real_class, mmap_dataptr_or_null);
+    R_set_altreal_Elt_method(mmap_real_class, mmap_elt);
+    R_set_altreal_Get_region_method(mmap_real_class, mmap_get_region);
+}
+
+#else
+
+void init_mmap(DllInfo *dll) {}
+
+SEXP mmap_real_alloc(R_xlen_t n, const char *dir) {
+    Rf_error("memory-mapped arrays aren't available on this platform");
+    return R_NilValue;
+}
+
+#endif
+
+// `list(available, ram)`: can arrays be memory-mapped here, and how many
+// bytes of physical memory there are (`NA` if unknown)
+SEXP mmap_info_C(void) {
+    double ram = NA_REAL;
+#if IJTIFF_MMAP && defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0) ram = (double)pages * page_size;
+#endif
+    SEXP out = PROTECT(Rf_allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(out, 0, Rf_ScalarLogical(IJTIFF_MMAP));
+    SET_VECTOR_ELT(out, 1, Rf_ScalarReal(ram));
+    UNPROTECT(1);
+    return out;
+}
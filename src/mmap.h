@@ -0,0 +1,28 @@
+#ifndef IJTIFF_MMAP_H
+#define IJTIFF_MMAP_H
+
+#include <stdbool.h>
+
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+// Double vectors whose elements live in a memory-mapped scratch file rather
+// than in R's heap (an ALTREP class), so that they can be bigger than RAM:
+// the OS pages in only the parts being used. Not available on Windows.
+#ifdef _WIN32
+#define IJTIFF_MMAP 0
+#else
+#define IJTIFF_MMAP 1
+#endif
+
+// Register the ALTREP class; called from R_init_ijtiff()
+void init_mmap(DllInfo *dll);
+
+// A new, zero-filled double vector of length `n` backed by a scratch file in
+// the directory `dir`. Errors if the file can't be made or mapped (e.g. if
+// there isn't room for it). The result needs PROTECTing.
+SEXP mmap_real_alloc(R_xlen_t n, const char *dir);
+
+SEXP mmap_info_C(void);
+
+#endif // IJTIFF_MMAP_H
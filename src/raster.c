@@ -0,0 +1,164 @@
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+// The first frame of a `[y, x, channel, frame]` array, which may be double,
+// integer (or logical) or raw
+typedef struct frame_view {
+  SEXPTYPE type;
+  const void *data;
+  R_xlen_t length, width, n_ch;
+} frame_view_t;
+
+static frame_view_t frame_view(SEXP img) {
+  frame_view_t v = {TYPEOF(img), NULL, 0, 0, 1};
+  SEXP dim = Rf_getAttrib(img, R_DimSymbol);
+  if (v.type != REALSXP && v.type != INTSXP && v.type != LGLSXP &&
+      v.type != RAWSXP) {
+    Rf_error("`img` must be a double, integer or raw array");
+  }
+  if (Rf_length(dim) < 2) Rf_error("`img` must be an array");
+  v.length = INTEGER(dim)[0];
+  v.width = INTEGER(dim)[1];
+  if (Rf_length(dim) > 2) v.n_ch = INTEGER(dim)[2];
+  v.data = (v.type == REALSXP) ? (const void*)REAL(img) :
+    (v.type == RAWSXP) ? (const void*)RAW(img) :
+    (v.type == INTSXP) ? (const void*)INTEGER(img) : (const void*)LOGICAL(img);
+  return v;
+}
+
+// Element `i` of the array as a double; NA (and NaN) as NA_REAL
+static inline double frame_elt(const frame_view_t *v, R_xlen_t i) {
+  if (v->type == REALSXP) return ((const double*)v->data)[i];
+  if (v->type == RAWSXP) return ((const Rbyte*)v->data)[i];
+  int x = ((const int*)v->data)[i];
+  return (x == NA_INTEGER) ? NA_REAL : x;
+}
+
+// `c(min, max)` of the first frame of `img`, ignoring NAs; both NA if every
+// value is NA
+SEXP frame_range_C(SEXP img) {
+  frame_view_t v = frame_view(img);
+  R_xlen_t n = v.length * v.width * v.n_ch;
+  double mn = R_PosInf, mx = R_NegInf;
+  for (R_xlen_t i = 0; i < n; ++i) {
+    double x = frame_elt(&v, i);
+    if (ISNAN(x)) continue;
+    if (x < mn) mn = x;
+    if (x > mx) mx = x;
+  }
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 2));
+  REAL(out)[0] = (mn <= mx) ? mn : NA_REAL;
+  REAL(out)[1] = (mn <= mx) ? mx : NA_REAL;
+  UNPROTECT(1);
+  return out;
+}
+
+// 0-255 color intensity of `x` on the scale from `lo` to `hi`, rounded as
+// grDevices::rgb() does
+static inline unsigned scale_intensity(double x, double lo, double hi) {
+  if (!(hi > lo)) return 0;
+  double t = (x - lo) / (hi - lo);
+  if (t < 0) t = 0;
+  if (t > 1) t = 1;
+  return (unsigned)(255 * t + 0.5);
+}
+
+// The first frame of `img` as a raster (a row-major matrix of "#RRGGBB"
+// strings), in one pass over the pixels (two with `sNormalize`). One channel
+// is shown in gray; otherwise the first three channels are composited as red,
+// green and blue. Each channel is scaled from 0 to `sMax`, or with
+// `sNormalize`, from its own minimum to maximum. With `sDownsample` = k > 1,
+// each k x k block of pixels becomes one raster pixel, their mean. Pixels with
+// an NA in any shown channel are white (and left out of block means).
+SEXP raster_C(SEXP img, SEXP sMax, SEXP sNormalize, SEXP sDownsample) {
+  frame_view_t v = frame_view(img);
+  double img_max = Rf_asReal(sMax);
+  bool normalize = Rf_asLogical(sNormalize) == TRUE;
+  R_xlen_t k = Rf_asInteger(sDownsample);
+  if (k < 1) k = 1;
+  int n_show = (v.n_ch == 1) ? 1 : (v.n_ch == 2) ? 2 : 3;
+  R_xlen_t plane = v.length * v.width;
+  double lo[3] = {0, 0, 0}, hi[3] = {img_max, img_max, img_max};
+  if (normalize) {
+    for (int c = 0; c < n_show; c++) {
+      lo[c] = R_PosInf;
+      hi[c] = R_NegInf;
+      for (R_xlen_t i = c * plane; i < (c + 1) * plane; i++) {
+        double x = frame_elt(&v, i);
+        if (ISNAN(x)) continue;
+        if (x < lo[c]) lo[c] = x;
+        if (x > hi[c]) hi[c] = x;
+      }
+    }
+  }
+  R_xlen_t out_length = (v.length + k - 1) / k;
+  R_xlen_t out_width = (v.width + k - 1) / k;
+  SEXP out = PROTECT(Rf_allocVector(STRSXP, out_length * out_width));
+  SEXP gray = PROTECT(Rf_allocVector(STRSXP, 256));  // gray levels made so far
+  bool have_gray[256] = {false};
+  SEXP white = PROTECT(Rf_mkChar("#FFFFFF"));
+  SEXP last = R_NilValue;
+  unsigned last_rgb = UINT_MAX;
+  char hex[8];
+  for (R_xlen_t ox = 0; ox < out_width; ox++) {
+    R_xlen_t x1 = (ox + 1) * k;
+    if (x1 > v.width) x1 = v.width;
+    for (R_xlen_t oy = 0; oy < out_length; oy++) {
+      R_xlen_t y1 = (oy + 1) * k;
+      if (y1 > v.length) y1 = v.length;
+      double sum[3] = {0, 0, 0};
+      R_xlen_t count = 0;
+      for (R_xlen_t x = ox * k; x < x1; x++) {
+        for (R_xlen_t y = oy * k; y < y1; y++) {
+          double px[3] = {0, 0, 0};
+          bool na = false;
+          for (int c = 0; c < n_show && !na; c++) {
+            px[c] = frame_elt(&v, c * plane + x * v.length + y);
+            na = ISNAN(px[c]);
+          }
+          if (na) continue;
+          for (int c = 0; c < n_show; c++) sum[c] += px[c];
+          count++;
+        }
+      }
+      SEXP col = white;
+      if (count) {
+        unsigned rgb[3] = {0, 0, 0};
+        for (int c = 0; c < n_show; c++)
+          rgb[c] = scale_intensity(sum[c] / count, lo[c], hi[c]);
+        if (n_show == 1) {
+          if (!have_gray[rgb[0]]) {
+            snprintf(hex, sizeof(hex), "#%02X%02X%02X",
+                     rgb[0], rgb[0], rgb[0]);
+            SET_STRING_ELT(gray, rgb[0], Rf_mkChar(hex));
+            have_gray[rgb[0]] = true;
+          }
+          col = STRING_ELT(gray, rgb[0]);
+        } else {
+          unsigned code = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+          if (code != last_rgb) {
+            snprintf(hex, sizeof(hex), "#%02X%02X%02X",
+                     rgb[0], rgb[1], rgb[2]);
+            last = Rf_mkChar(hex);
+            last_rgb = code;
+          }
+          col = last;
+        }
+      }
+      SET_STRING_ELT(out, oy * out_width + ox, col);  // rasters are row-major
+    }
+  }
+  SEXP dim = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(dim)[0] = out_length;
+  INTEGER(dim)[1] = out_width;
+  Rf_setAttrib(out, R_DimSymbol, dim);
+  Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("raster"));
+  UNPROTECT(4);
+  return out;
+}
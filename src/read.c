@@ -3,9 +3,14 @@
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <limits.h>
 
 #include "common.h"
 #include "tags.h"
+#include "decode.h"
+#include "handle.h"
+#include "mmap.h"
+#include "trace.h"
 
 #include <Rinternals.h>
 
@@ -17,293 +22,219 @@ static TIFF* validate_and_open_tiff(SEXP sFn, tiff_job_t *rj, FILE **f, const ch
     return open_tiff_file(*fn, rj, f);
 }
 
-// Helper function to handle errors with proper cleanup
-static void handle_error(TIFF *tiff, FILE *f, const char *message, ...) {
-    va_list args;
-    va_start(args, message);
-    TIFFClose(tiff);
-    Rf_error(message, args);
-    va_end(args);
-}
+// Destination of decoded rows: planes `p0` onwards of a column-major
+// `[y, x, plane]` array, which may be double, integer or raw
+typedef struct typed_sink {
+    SEXPTYPE type;
+    void *arr;
+    uint32_t length, width;
+    R_xlen_t p0;
+} typed_sink_t;
 
-// Helper function to copy pixel value based on bit depth and type
-static double get_pixel_value(const unsigned char *v, uint16_t bps, bool is_float) {
-    if (bps == 8) {
-        return (double)v[0];
-    } else if (bps == 16) {
-        return (double)((const uint16_t*)v)[0];
-    } else if (bps == 32) {
-        if (is_float) {
-            return (double)((const float*)v)[0];
+static void typed_sink_visit(void *ctx, uint32_t y, uint32_t x0, uint32_t n,
+                             uint16_t s0, uint16_t ns, const double *vals) {
+    typed_sink_t *sink = (typed_sink_t*) ctx;
+    R_xlen_t plane = (R_xlen_t)sink->length * sink->width;
+    for (uint16_t k = 0; k < ns; k++) {
+        R_xlen_t start = (sink->p0 + s0 + k) * plane +
+            (R_xlen_t)sink->length * x0 + y;
+        const double *v = vals + k;
+        uint32_t i;
+        if (sink->type == REALSXP) {
+            double *dest = (double*)sink->arr + start;
+            for (i = 0; i < n; i++) dest[(size_t)sink->length * i] = v[(size_t)i * ns];
+        } else if (sink->type == INTSXP) {
+            int *dest = (int*)sink->arr + start;
+            for (i = 0; i < n; i++) {
+                double x = v[(size_t)i * ns];
+                dest[(size_t)sink->length * i] =
+                    (ISNAN(x) || x > INT_MAX) ? NA_INTEGER : (int)x;
+            }
         } else {
-            return (double)((const uint32_t*)v)[0];
+            Rbyte *dest = (Rbyte*)sink->arr + start;
+            for (i = 0; i < n; i++) dest[(size_t)sink->length * i] = (Rbyte)v[(size_t)i * ns];
         }
     }
-    return NA_REAL;
 }
 
-// Helper function to set pixel values for multiple samples
-static void set_pixel_values(double *real_arr, const unsigned char *v, uint16_t bps, 
-                            uint16_t spp, bool is_float, uint32_t imageLength, 
-                            uint32_t imageWidth, uint32_t x, uint32_t y) {
-    size_t j;
-    for (j = 0; j < spp; j++) {
-        size_t offset = (imageLength * imageWidth * j) + imageLength * x + y;
-        if (bps == 8) {
-            real_arr[offset] = (double)v[j];
-        } else if (bps == 16) {
-            real_arr[offset] = (double)((const uint16_t*)v)[j];
-        } else if (bps == 32) {
-            if (is_float) {
-                real_arr[offset] = (double)((const float*)v)[j];
-            } else {
-                real_arr[offset] = (double)((const uint32_t*)v)[j];
-            }
-        }
+// Store `x` at element `i` of a double, integer or raw array
+static inline void typed_store(SEXPTYPE type, void *arr, R_xlen_t i, double x) {
+    if (type == REALSXP) {
+        ((double*)arr)[i] = x;
+    } else if (type == INTSXP) {
+        ((int*)arr)[i] = (ISNAN(x) || x > INT_MAX) ? NA_INTEGER : (int)x;
+    } else {
+        ((Rbyte*)arr)[i] = (Rbyte)x;
     }
 }
 
-SEXP read_tif_C(SEXP sFn /*filename*/, SEXP sDirs) {
-    check_type_sizes();
-    int to_unprotect = 0;
-    SEXP multi_res = R_NilValue;
-    SEXP multi_tail = multi_res;
-    SEXP res = R_NilValue;
-    SEXP dim = R_NilValue;
-    const char *fn;
-    TIFF *tiff = NULL;
-    FILE *f = NULL;
-    tiff_job_t rj;
-    
-    // Create a protected pointer for TIFF cleanup
-    SEXP tiff_closer = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
-    to_unprotect++;
-    
-    // Set up finalizer that checks if pointer is NULL before closing
-    R_RegisterCFinalizerEx(tiff_closer, (R_CFinalizer_t)cleanup_tiff_ptr, TRUE);
-    
-    tiff = validate_and_open_tiff(sFn, &rj, &f, &fn);
-    
-    if (!tiff) {
-        Rf_error("Failed to open TIFF file");
-    }
-    
-    // Store the TIFF pointer
-    R_SetExternalPtrAddr(tiff_closer, tiff);
-    
-    int cur_dir = 0; // 1-based image number
-    int *sDirs_intptr = INTEGER(sDirs), cur_sDir_index = 0;
-    int sDirs_len = LENGTH(sDirs);
-    while (cur_sDir_index != sDirs_len) {  // read only from images in desired directories
-        ++cur_dir;
-        bool is_match = cur_dir == sDirs_intptr[cur_sDir_index];
-        if (is_match) {
-            ++cur_sDir_index;
-        } else {
-            if (TIFFReadDirectory(tiff)) {
-                continue;
-            } else {
-                break;  // safety net: I don't expect this line to ever be needed
+// Destination of decoded rows that shrinks the image by a factor of `k` in
+// each direction as they arrive: each `k` x `k` block of pixels becomes its
+// mean (summed into the double array `out.arr`, then finished by
+// downsample_finish()) or its top-left pixel
+typedef struct downsample_sink {
+    typed_sink_t out;  // sized ceil(length / k) x ceil(width / k)
+    uint32_t k;
+    uint32_t length, width;  // of the full-resolution image
+    int method;
+} downsample_sink_t;
+
+static void downsample_sink_visit(void *ctx, uint32_t y, uint32_t x0,
+                                  uint32_t n, uint16_t s0, uint16_t ns,
+                                  const double *vals) {
+    downsample_sink_t *sink = (downsample_sink_t*) ctx;
+    uint32_t k = sink->k;
+    if (sink->method == DOWNSAMPLE_NEAREST && y % k) return;
+    R_xlen_t out_length = sink->out.length;
+    R_xlen_t plane = out_length * sink->out.width;
+    R_xlen_t row = y / k;
+    uint32_t i = (sink->method == DOWNSAMPLE_NEAREST) ? (k - x0 % k) % k : 0;
+    if (sink->method == DOWNSAMPLE_NEAREST) {
+        for (; i < n; i += k) {
+            R_xlen_t base = (R_xlen_t)((x0 + i) / k) * out_length + row;
+            for (uint16_t s = 0; s < ns; s++) {
+                typed_store(sink->out.type, sink->out.arr,
+                            (s0 + s) * plane + base, vals[(size_t)i * ns + s]);
             }
         }
-        uint32_t imageWidth = 0, imageLength = 0, imageDepth;
-        uint32_t tileWidth, tileLength;
-        uint32_t x, y;
-        uint16_t config, bps = 8, spp = 1, sformat = 1, out_spp;
-        tdata_t buf;
-        double *real_arr;
-        uint16_t *colormap[3] = {0, 0, 0};
-        bool is_float = false;
-        TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &imageWidth);
-        TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &imageLength);
-        if (!TIFFGetField(tiff, TIFFTAG_IMAGEDEPTH, &imageDepth)) imageDepth = 0;
-        if (TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tileWidth)) {
-            TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tileLength);
-        } else {  // no tiles
-            tileWidth = tileLength = 0;
-        }
-        TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &config);
-        TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bps);
-        TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &spp);
-        out_spp = spp;
-        TIFFGetField(tiff, TIFFTAG_COLORMAP, colormap, colormap + 1, colormap + 2);
-        if (TIFFGetField(tiff, TIFFTAG_SAMPLEFORMAT, &sformat) &&
-            sformat == SAMPLEFORMAT_IEEEFP) {
-            is_float = true;
+    } else {
+        double *sum = (double*)sink->out.arr;
+        for (; i < n; i++) {
+            R_xlen_t base = (R_xlen_t)((x0 + i) / k) * out_length + row;
+            for (uint16_t s = 0; s < ns; s++) {
+                sum[(s0 + s) * plane + base] += vals[(size_t)i * ns + s];
+            }
         }
-        if (spp == 1) { /* modify out_spp for colormaps */
-            if (colormap[2]) {
-                out_spp = 3;
-            } else if (colormap[1]) {
-                out_spp = 2;
+    }
+}
+
+// Turn the block sums of a DOWNSAMPLE_MEAN sink into means, rounded unless
+// the samples are floating point. Blocks at the right and bottom edges may be
+// smaller than `k` x `k`.
+static void downsample_finish(downsample_sink_t *sink, uint16_t planes,
+                              bool is_float) {
+    double *sum = (double*)sink->out.arr;
+    uint32_t k = sink->k;
+    for (uint16_t p = 0; p < planes; p++) {
+        for (uint32_t ox = 0; ox < sink->out.width; ox++) {
+            uint32_t cols = sink->width - ox * k;
+            if (cols > k) cols = k;
+            double *col = sum + ((R_xlen_t)p * sink->out.width + ox) *
+                sink->out.length;
+            for (uint32_t oy = 0; oy < sink->out.length; oy++) {
+                uint32_t rows = sink->length - oy * k;
+                if (rows > k) rows = k;
+                double mean = col[oy] / ((double)rows * cols);
+                col[oy] = is_float ? mean : nearbyint(mean);
             }
         }
-        #if TIFF_DEBUG
-            Rprintf("image %d x %d x %d, tiles %d x %d, bps = %d, spp = %d (output %d), "
-                    "config = %d, colormap = %s\n",
-                    imageWidth, imageLength, imageDepth, tileWidth, tileLength, bps, spp,
-                    out_spp, config, colormap[0] ? "yes" : "no");
-        #endif
-        if (bps == 12) {
-            handle_error(tiff, f, "12-bit images are not supported. "
-                     "Try converting your image to 16-bit.");
+    }
+}
+
+// Fill `info` for the current directory of `h`, or for its `level`th
+// reduced-resolution SubIFD (in which case the offset of the main directory,
+// to go back to afterwards with trace_set_subdirectory(), is returned).
+// Errors, closing `ptr` first if `close_on_error`, if that's impossible or
+// the directory can't be decoded.
+static toff_t prep_frame(tif_handle_t *h, SEXP ptr, int dir, int level,
+                         frame_info_t *info, bool close_on_error) {
+    toff_t main_off = 0;
+    if (level > 0) {  // read the reduced-resolution SubIFD instead
+        uint16_t n_sub = 0;
+        toff_t *sub_offsets = NULL;
+        if (!TIFFGetField(h->tiff, TIFFTAG_SUBIFD, &n_sub, &sub_offsets) ||
+            n_sub < level) {
+            if (close_on_error) close_handle(ptr);
+            Rf_error("Frame (directory) %d has %d reduced-resolution "
+                     "level(s), so level %d can't be read.",
+                     dir, n_sub, level);
         }
-        if (bps != 8 && bps != 16 && bps != 32) {
-            handle_error(tiff, f, "image has %d bits/sample which is unsupported", bps);
+        main_off = TIFFCurrentDirOffset(h->tiff);
+        if (!trace_set_subdirectory(h->tiff, sub_offsets[level - 1])) {
+            if (close_on_error) close_handle(ptr);
+            Rf_error("Failed to read reduced-resolution level %d of frame "
+                     "(directory) %d.", level, dir);
         }
-        if (sformat == SAMPLEFORMAT_INT)
-            Rf_warning("The \'ijtiff\' package only supports unsigned "
-                       "integer or float sample formats, but your image contains "
-                       "the signed integer format.");
-        res = PROTECT(allocVector(REALSXP, imageWidth * imageLength * out_spp));
-        to_unprotect++;  // res needs to be UNPROTECTed later
-        real_arr = REAL(res);
-        if (tileWidth == 0) {
-            tstrip_t strip;
-            tsize_t plane_offset = 0;
-            x = 0; y = 0;
-            buf = _TIFFmalloc(TIFFStripSize(tiff));
-            #if TIFF_DEBUG
-                Rprintf(" - %d x %d strips\n",
-                        TIFFNumberOfStrips(tiff), TIFFStripSize(tiff));
-            #endif
-            for (strip = 0; strip < TIFFNumberOfStrips(tiff); strip++) {
-                tsize_t n = TIFFReadEncodedStrip(tiff, strip, buf, (tsize_t) -1);
-                if (spp == 1) { // config doesn't matter for spp == 1
-                    if (colormap[0]) {
-                        tsize_t i, step = bps / 8;
-                        for (i = 0; i < n; i += step) {
-                            uint32_t ci = 0;
-                            const uint8_t *v = (const uint8_t*) buf + i;
-                            if (bps == 8) {
-                                ci = v[0];
-                            } else if (bps == 16) {
-                                ci = ((const uint16_t*)v)[0];
-                            } else if (bps == 32) {
-                                ci = ((const uint32_t*)v)[0];
-                            }
-                            if (is_float) {
-                                real_arr[imageLength * x + y] = (double) colormap[0][ci];
-                                // color maps are always 16-bit
-                                if (colormap[1]) {
-                                    real_arr[(imageLength * imageWidth) + imageLength * x + y] =
-                                        (double) colormap[1][ci];
-                                    if (colormap[2]) {
-                                        real_arr[(2 * imageLength * imageWidth) +
-                                                 imageLength * x + y] = (double) colormap[2][ci];
-                                    }
-                                }
-                            } else {
-                                real_arr[imageLength * x + y] = colormap[0][ci];
-                                // color maps are always 16-bit
-                                if (colormap[1]) {
-                                    real_arr[(imageLength * imageWidth) + imageLength * x + y] =
-                                        colormap[1][ci];
-                                    if (colormap[2]) {
-                                        real_arr[(2 * imageLength * imageWidth) +
-                                                 imageLength * x + y] = colormap[2][ci];
-                                    }
-                                }
-                            }
-                            x++;
-                            if (x >= imageWidth) {
-                                x -= imageWidth;
-                                y++;
-                            }
-                        }
-                    } else { // direct gray
-                        tsize_t i, step = bps / 8;
-                        for (i = 0; i < n; i += step) {
-                            const uint8_t *v = (const uint8_t*) buf + i;
-                            real_arr[imageLength * x + y] = get_pixel_value(v, bps, is_float);
-                            x++;
-                            if (x >= imageWidth) {
-                                x -= imageWidth;
-                                y++;
-                            }
-                        }
-                    }
-                } else if (config == PLANARCONFIG_CONTIG) { // interlaced
-                    tsize_t i, step = spp * bps / 8;
-                    for (i = 0; i < n; i += step) {
-                        const uint8_t *v = (const uint8_t*) buf + i;
-                        set_pixel_values(real_arr, v, bps, spp, is_float, imageLength, imageWidth, x, y);
-                        x++;
-                        if (x >= imageWidth) {
-                            x -= imageWidth;
-                            y++;
-                        }
-                    }
-                } else {  // separate
-                    tsize_t step = bps / 8, i;
-                    for (i = 0; i < n; i += step) {
-                        const unsigned char *v = (const unsigned char*) buf + i;
-                        real_arr[plane_offset + imageLength * x + y] = get_pixel_value(v, bps, is_float);
-                        x++;
-                        if (x >= imageWidth) {
-                            x -= imageWidth;
-                            y++;
-                            if (y >= imageLength) {
-                                y -= imageLength;
-                                plane_offset += imageWidth * imageLength;
-                            }
-                        }
-                    }
-                }
-            }
-        } else {  // tiled image
-            if (spp > 1 && config != PLANARCONFIG_CONTIG) {
-                handle_error(tiff, f, "Planar format tiled images are not supported");
-            }
+    }
+    char problem[256];
+    get_frame_info(h->tiff, info);
+    if (frame_info_problem(info, problem, sizeof(problem))) {
+        if (close_on_error) close_handle(ptr);
+        Rf_error("%s", problem);
+    }
+    return main_off;
+}
 
-            #if TIFF_DEBUG
-                Rprintf(" - %d x %d tiles\n", TIFFNumberOfTiles(tiff), TIFFTileSize(tiff));
-            #endif
-            x = 0; y = 0;
-            buf = _TIFFmalloc(TIFFTileSize(tiff));
+// Decode the current directory into `out` (its planes starting at
+// `out.arr`, each sized for the image shrunk by `k`)
+static void decode_frame_into(tif_handle_t *h, const frame_info_t *info,
+                              typed_sink_t out, uint32_t k,
+                              int downsample_method) {
+    if (k == 1) {
+        decode_frame(h->tiff, info, &h->scratch, typed_sink_visit, &out);
+        return;
+    }
+    // averaging palette indices or colors would make new colors
+    int method = (out.type == REALSXP && !info->colormap[0]) ?
+        downsample_method : DOWNSAMPLE_NEAREST;
+    downsample_sink_t ds = {out, k, info->length, info->width, method};
+    if (method == DOWNSAMPLE_MEAN) {
+        memset(out.arr, 0, (size_t)out.length * out.width * info->out_spp *
+               sizeof(double));
+    }
+    decode_frame(h->tiff, info, &h->scratch, downsample_sink_visit, &ds);
+    if (method == DOWNSAMPLE_MEAN)
+        downsample_finish(&ds, info->out_spp, info->is_float);
+}
 
-            for (y = 0; y < imageLength; y += tileLength) {
-                for (x = 0; x < imageWidth; x += tileWidth) {
-                    tsize_t n = TIFFReadTile(tiff, buf, x, y, 0 /*depth*/, 0 /*plane*/);
-                    if (spp == 1) { // config doesn't matter for spp == 1
-                        // direct gray */
-                        tsize_t i, step = bps / 8;
-                        uint32_t xoff = 0, yoff = 0;
-                        for (i = 0; i < n; i += step) {
-                            const unsigned char *v = (const unsigned char*) buf + i;
-                            if (x + xoff < imageWidth && y + yoff < imageLength) {
-                                real_arr[imageLength * (x + xoff) + y + yoff] = get_pixel_value(v, bps, is_float);
-                            }
-                            xoff++;
-                            if (xoff >= tileWidth) {
-                                xoff -= tileWidth;
-                                yoff++;
-                            }
-                        }
-                    } else if (config == PLANARCONFIG_CONTIG) {  // spp > 1, interlaced
-                        tsize_t i, step = spp * bps / 8;
-                        uint32_t xoff = 0, yoff = 0;
-                        for (i = 0; i < n; i += step) {
-                            const unsigned char *v = (const uint8_t*) buf + i;
-                            if (x + xoff < imageWidth && y + yoff < imageLength) {
-                                set_pixel_values(real_arr, v, bps, spp, is_float, imageLength, imageWidth, x + xoff, y + yoff);
-                            }
-                            xoff++;
-                            if (xoff >= tileWidth) {
-                                xoff -= tileWidth;
-                                yoff++;
-                            }
-                        }
-                    }
+SEXP handle_read_dirs(SEXP ptr, SEXP sDirs, int palette, int level,
+                      int downsample, int downsample_method,
+                      bool close_on_error) {
+    tif_handle_t *h = get_handle(ptr);
+    int to_unprotect = 0;
+    SEXP multi_res = R_NilValue;
+    SEXP multi_tail = multi_res;
+    SEXP res = R_NilValue;
+    SEXP dim = R_NilValue;
+    int *sDirs_intptr = INTEGER(sDirs);
+    int sDirs_len = LENGTH(sDirs);
+    for (int i = 0; i != sDirs_len; ++i) {  // read only the desired directories
+        if (!handle_seek_dir(h, sDirs_intptr[i])) {
+            break;  // safety net: I don't expect this line to ever be needed
+        }
+        frame_info_t info;
+        toff_t main_off = prep_frame(h, ptr, sDirs_intptr[i], level, &info,
+                                     close_on_error);
+        SEXPTYPE type = REALSXP;
+        if (palette != PALETTE_EXPAND && info.spp == 1 && info.colormap[0]) {
+            drop_colormap(&info);
+            type = INTSXP;
+            if (palette == PALETTE_RAW) {
+                if (info.bps != 8) {
+                    if (close_on_error) close_handle(ptr);
+                    Rf_error("The palette indices are %d-bit so they "
+                             "can't be read as raw.", info.bps);
                 }
+                type = RAWSXP;
             }
         }
-        _TIFFfree(buf);
-        dim = PROTECT(allocVector(INTSXP, (out_spp > 1) ? 3 : 2));
+        uint32_t k = (downsample > 1) ? (uint32_t)downsample : 1;
+        uint32_t out_length = (info.length + k - 1) / k;
+        uint32_t out_width = (info.width + k - 1) / k;
+        res = PROTECT(allocVector(type,
+                                  (R_xlen_t)out_width * out_length * info.out_spp));
+        to_unprotect++;  // res needs to be UNPROTECTed later
+        typed_sink_t sink = {type, NULL, out_length, out_width, 0};
+        sink.arr = (type == REALSXP) ? (void*)REAL(res) :
+            (type == INTSXP) ? (void*)INTEGER(res) : (void*)RAW(res);
+        decode_frame_into(h, &info, sink, k, downsample_method);
+        // back to the main chain of directories for handle_seek_dir()
+        if (level > 0) trace_set_subdirectory(h->tiff, main_off);
+        dim = PROTECT(allocVector(INTSXP, (info.out_spp > 1) ? 3 : 2));
         to_unprotect++;
-        INTEGER(dim)[0] = imageLength;
-        INTEGER(dim)[1] = imageWidth;
-        if (out_spp > 1) INTEGER(dim)[2] = out_spp;
+        INTEGER(dim)[0] = out_length;
+        INTEGER(dim)[1] = out_width;
+        if (info.out_spp > 1) INTEGER(dim)[2] = info.out_spp;
         setAttrib(res, R_DimSymbol, dim);
         Rf_unprotect(1);  // UNPROTECT `dim`
         to_unprotect--;
@@ -318,19 +249,159 @@ SEXP read_tif_C(SEXP sFn /*filename*/, SEXP sDirs) {
             Rf_unprotect(2);  // removing explit PROTECTion of `q` UNPROTECTing `res`
             to_unprotect -= 2;
         }
-        if (!TIFFReadDirectory(tiff))
-            break;
     }
-    // Clear the external pointer to avoid double closing
-    TIFFClose(tiff);
-    R_ClearExternalPtr(tiff_closer);
-    
     res = PROTECT(PairToVectorList(multi_res));  // convert LISTSXP into VECSXP
     to_unprotect++;
     Rf_unprotect(to_unprotect);
     return res;
 }
 
+SEXP read_tif_C(SEXP sFn /*filename*/, SEXP sDirs, SEXP sPalette, SEXP sLevel,
+                SEXP sDownsample, SEXP sDownsampleMethod, SEXP sReadahead) {
+    check_type_sizes();
+    SEXP ptr = PROTECT(open_handle(sFn, "r"));
+    get_handle(ptr)->scratch.readahead = Rf_asInteger(sReadahead);
+    SEXP res = PROTECT(handle_read_dirs(ptr, sDirs, Rf_asInteger(sPalette),
+                                        Rf_asInteger(sLevel),
+                                        Rf_asInteger(sDownsample),
+                                        Rf_asInteger(sDownsampleMethod), true));
+    close_handle(ptr);
+    UNPROTECT(2);
+    return res;
+}
+
+// Decode directories `sDirs` (in order, all the same size) into consecutive
+// planes of one double array with dimensions `sDim`, memory-mapped from a
+// scratch file in the directory `sScratch` so that it can be bigger than RAM.
+// Palette images aren't supported.
+SEXP read_tif_mmap_C(SEXP sFn, SEXP sDirs, SEXP sLevel, SEXP sDownsample,
+                     SEXP sDownsampleMethod, SEXP sReadahead, SEXP sDim,
+                     SEXP sScratch) {
+    check_type_sizes();
+    R_xlen_t n = 1;
+    for (int i = 0; i < LENGTH(sDim); i++) n *= INTEGER(sDim)[i];
+    uint32_t out_length = INTEGER(sDim)[0], out_width = INTEGER(sDim)[1];
+    SEXP res = PROTECT(mmap_real_alloc(
+        n, R_ExpandFileName(CHAR(STRING_ELT(sScratch, 0)))));
+    SEXP ptr = PROTECT(open_handle(sFn, "r"));
+    tif_handle_t *h = get_handle(ptr);
+    h->scratch.readahead = Rf_asInteger(sReadahead);
+    int level = Rf_asInteger(sLevel);
+    uint32_t k = (uint32_t)Rf_asInteger(sDownsample);
+    R_xlen_t plane = (R_xlen_t)out_length * out_width, p0 = 0;
+    int *dirs = INTEGER(sDirs);
+    for (int i = 0; i != LENGTH(sDirs); ++i) {
+        if (!handle_seek_dir(h, dirs[i])) {
+            close_handle(ptr);
+            Rf_error("directory %d does not exist", dirs[i]);
+        }
+        frame_info_t info;
+        toff_t main_off = prep_frame(h, ptr, dirs[i], level, &info, true);
+        if ((info.length + k - 1) / k != out_length ||
+            (info.width + k - 1) / k != out_width || info.colormap[0] ||
+            (p0 + info.out_spp) * plane > n) {
+            close_handle(ptr);
+            Rf_error("Frame (directory) %d doesn't fit the %u x %u array "
+                     "being read into.", dirs[i], out_length, out_width);
+        }
+        typed_sink_t sink = {REALSXP, REAL(res) + p0 * plane, out_length,
+                             out_width, 0};
+        decode_frame_into(h, &info, sink, k, Rf_asInteger(sDownsampleMethod));
+        if (level > 0) trace_set_subdirectory(h->tiff, main_off);
+        p0 += info.out_spp;
+        R_CheckUserInterrupt();
+    }
+    close_handle(ptr);
+    setAttrib(res, R_DimSymbol, sDim);
+    UNPROTECT(2);
+    return res;
+}
+
+SEXP tif_handle_read_C(SEXP ptr, SEXP sDirs) {
+    return handle_read_dirs(ptr, sDirs, PALETTE_EXPAND, 0, 1, DOWNSAMPLE_MEAN,
+                            false);
+}
+
+// Destination of decoded rows for EBImage: planes `p0` onwards of a
+// column-major `[x, y, plane]` double array (so each run of pixels is
+// contiguous), with every sample divided by `scale`
+typedef struct ebimage_sink {
+    double *arr;
+    uint32_t width, length;
+    R_xlen_t p0;
+    double scale;
+} ebimage_sink_t;
+
+static void ebimage_sink_visit(void *ctx, uint32_t y, uint32_t x0, uint32_t n,
+                               uint16_t s0, uint16_t ns, const double *vals) {
+    ebimage_sink_t *sink = (ebimage_sink_t*) ctx;
+    R_xlen_t plane = (R_xlen_t)sink->length * sink->width;
+    double scale = sink->scale;
+    for (uint16_t k = 0; k < ns; k++) {
+        double *dest = sink->arr + (sink->p0 + s0 + k) * plane +
+            (R_xlen_t)sink->width * y + x0;
+        const double *v = vals + k;
+        for (uint32_t i = 0; i < n; i++) dest[i] = v[(size_t)i * ns] / scale;
+    }
+}
+
+// Decode directories `sDirs` (in order, all the same size) into consecutive
+// planes of one `[x, y, plane]` double array, the layout of EBImage. Unsigned
+// integer samples are scaled to [0, 1] by their bit depth (signed ones to
+// [-1, 1] and palette colors by 65535) as they're decoded. The caller sets
+// the dimensions.
+SEXP read_ebimage_C(SEXP sFn, SEXP sDirs, SEXP sReadahead) {
+    check_type_sizes();
+    SEXP ptr = PROTECT(open_handle(sFn, "r"));
+    tif_handle_t *h = get_handle(ptr);
+    h->scratch.readahead = Rf_asInteger(sReadahead);
+    int *dirs = INTEGER(sDirs), n_dirs = LENGTH(sDirs);
+    // allocated once the first directory's size is known
+    SEXP res = R_NilValue;
+    PROTECT_INDEX res_ipx;
+    PROTECT_WITH_INDEX(res, &res_ipx);
+    ebimage_sink_t sink = {NULL, 0, 0, 0, 1};
+    uint16_t out_spp = 0;
+    for (int i = 0; i != n_dirs; ++i) {
+        if (!handle_seek_dir(h, dirs[i])) {
+            close_handle(ptr);
+            Rf_error("directory %d does not exist", dirs[i]);
+        }
+        frame_info_t info;
+        char problem[256];
+        get_frame_info(h->tiff, &info);
+        if (frame_info_problem(&info, problem, sizeof(problem))) {
+            close_handle(ptr);
+            Rf_error("%s", problem);
+        }
+        if (i == 0) {
+            sink.width = info.width;
+            sink.length = info.length;
+            out_spp = info.out_spp;
+            res = allocVector(REALSXP, (R_xlen_t)info.width * info.length *
+                              out_spp * n_dirs);
+            REPROTECT(res, res_ipx);
+            sink.arr = REAL(res);
+        } else if (info.width != sink.width || info.length != sink.length ||
+                   info.out_spp != out_spp) {
+            close_handle(ptr);
+            Rf_error("Frame (directory) %d is %u x %u x %u but the first is "
+                     "%u x %u x %u. Frames of different sizes can't be read "
+                     "into one EBImage.", dirs[i], info.length, info.width,
+                     info.out_spp, sink.length, sink.width, out_spp);
+        }
+        sink.scale = info.colormap[0] ? 65535 : info.is_float ? 1 :
+            (info.sformat == SAMPLEFORMAT_INT) ? ldexp(1, info.bps - 1) - 1 :
+            ldexp(1, info.bps) - 1;
+        decode_frame(h->tiff, &info, &h->scratch, ebimage_sink_visit, &sink);
+        sink.p0 += out_spp;
+    }
+    close_handle(ptr);
+    if (res == R_NilValue) res = allocVector(REALSXP, 0);
+    UNPROTECT(2);
+    return res;
+}
+
 SEXP count_directories_C(SEXP sFn /*FileName*/) {
     check_type_sizes();
     int to_unprotect = 0;
@@ -360,7 +431,7 @@ SEXP count_directories_C(SEXP sFn /*FileName*/) {
     R_xlen_t cur_dir = 0; // 1-based image number
     while (1) {  // loop over TIFF directories
         cur_dir++;
-        if (!TIFFReadDirectory(tiff)) break;
+        if (!trace_read_directory(tiff)) break;
     }
     
     TIFFClose(tiff);
@@ -371,3 +442,59 @@ SEXP count_directories_C(SEXP sFn /*FileName*/) {
     Rf_unprotect(to_unprotect);
     return res;
 }
+
+// Decode directories `sDirs` (in order) into consecutive planes of the
+// existing array `sBuf`, allocating nothing once the handle's scratch buffers
+// have grown to size. Palette images are decoded as their index plane.
+SEXP tif_handle_read_into_C(SEXP ptr, SEXP sDirs, SEXP sBuf) {
+    tif_handle_t *h = get_handle(ptr);
+    SEXPTYPE type = TYPEOF(sBuf);
+    if (type != REALSXP && type != INTSXP && type != RAWSXP)
+        Rf_error("`buf` must be a double, integer or raw array");
+    // Where R would copy `buf` before modifying it, other objects share its
+    // memory and decoding into it would change them too
+    if (MAYBE_SHARED(sBuf)) {
+        Rf_error("`buf` is shared with another R object, which reading into "
+                 "it would change too. Read into a new array instead.");
+    }
+    SEXP dim = getAttrib(sBuf, R_DimSymbol);
+    if (LENGTH(dim) < 2 || LENGTH(dim) > 4)
+        Rf_error("`buf` must be an array with 2, 3 or 4 dimensions");
+    if (LENGTH(dim) == 4 && INTEGER(dim)[3] != 1)
+        Rf_error("`buf` can only hold one frame");
+    uint32_t length = INTEGER(dim)[0], width = INTEGER(dim)[1];
+    R_xlen_t n_planes = (length && width) ?
+        XLENGTH(sBuf) / ((R_xlen_t)length * width) : 0;
+    void *arr = (type == REALSXP) ? (void*)REAL(sBuf) :
+        (type == INTSXP) ? (void*)INTEGER(sBuf) : (void*)RAW(sBuf);
+    typed_sink_t sink = {type, arr, length, width, 0};
+    int *dirs = INTEGER(sDirs);
+    for (int i = 0; i != LENGTH(sDirs); ++i) {
+        if (!handle_seek_dir(h, dirs[i]))
+            Rf_error("directory %d does not exist", dirs[i]);
+        frame_info_t info;
+        char problem[256];
+        get_frame_info(h->tiff, &info);
+        if (frame_info_problem(&info, problem, sizeof(problem)))
+            Rf_error("%s", problem);
+        drop_colormap(&info);
+        if (info.length != length || info.width != width ||
+            sink.p0 + info.spp > n_planes) {
+            Rf_error("directory %d (%u x %u x %u) doesn't fit in `buf` "
+                     "(%u x %u x %td)", dirs[i], info.length, info.width,
+                     info.spp, length, width, (ptrdiff_t)n_planes);
+        }
+        if (type == INTSXP && info.is_float)
+            Rf_error("cannot read a floating point image into an integer buffer");
+        if (type == RAWSXP && info.bps != 8)
+            Rf_error("cannot read a %d-bit image into a raw buffer", info.bps);
+        if (type == RAWSXP && info.sformat == SAMPLEFORMAT_INT)
+            Rf_error("cannot read a signed integer image into a raw buffer");
+        decode_frame(h->tiff, &info, &h->scratch, typed_sink_visit, &sink);
+        sink.p0 += info.spp;
+    }
+    if (sink.p0 != n_planes)
+        Rf_error("the frame has %td planes but `buf` has %td",
+                 (ptrdiff_t)sink.p0, (ptrdiff_t)n_planes);
+    return sBuf;
+}
@@ -0,0 +1,292 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "decode.h"
+#include "handle.h"
+
+#include <R.h>
+#include <Rinternals.h>
+
+// Number of bins used to approximate percentiles of 32-bit and float samples
+#define N_FINE_BINS 65536
+
+// Columns of the stats matrix before the requested percentiles
+#define N_STAT_COLS 8
+
+// Running summary of one sample (channel) of one directory
+typedef struct sample_acc {
+    double n, n_na, min, max, sum, m2;
+    double *counts;  // exact value counts or fine bins, for percentiles
+    double *hist;  // output histogram
+} sample_acc_t;
+
+typedef struct stats_ctx {
+    sample_acc_t *acc;
+    bool exact;  // counts are indexed by sample value
+    int pass;  // 1: min/max/mean, 2: binning (only when !exact)
+    int n_bins;
+    double lo, hi;  // output histogram range, NaN if per-sample
+    double *fine_lo, *fine_w;  // per-sample fine bin starts and widths
+} stats_ctx_t;
+
+static void stats_visit(void *ctx, uint32_t y, uint32_t x0, uint32_t n,
+                        uint16_t s0, uint16_t ns, const double *vals) {
+    stats_ctx_t *sc = (stats_ctx_t*) ctx;
+    for (uint16_t k = 0; k < ns; k++) {
+        sample_acc_t *a = sc->acc + s0 + k;
+        const double *v = vals + k;
+        if (sc->exact) {
+            for (uint32_t i = 0; i < n; i++) {
+                a->counts[(uint32_t)v[(size_t)i * ns]]++;
+            }
+        } else if (sc->pass == 1) {
+            for (uint32_t i = 0; i < n; i++) {
+                double val = v[(size_t)i * ns];
+                if (ISNAN(val)) {
+                    a->n_na++;
+                    continue;
+                }
+                if (val < a->min) a->min = val;
+                if (val > a->max) a->max = val;
+                a->sum += val;
+                a->n++;
+            }
+        } else {
+            double mean = a->sum / a->n;
+            double lo = ISNAN(sc->lo) ? a->min : sc->lo;
+            double hi = ISNAN(sc->hi) ? a->max : sc->hi;
+            double scale = sc->n_bins / (hi > lo ? hi - lo : 1);
+            double flo = sc->fine_lo[s0 + k], fw = sc->fine_w[s0 + k];
+            for (uint32_t i = 0; i < n; i++) {
+                double val = v[(size_t)i * ns];
+                if (ISNAN(val)) continue;
+                a->m2 += (val - mean) * (val - mean);
+                size_t fb = (size_t)((val - flo) / fw);
+                if (fb >= N_FINE_BINS) fb = N_FINE_BINS - 1;
+                a->counts[fb]++;
+                if (val >= lo && val <= hi) {
+                    size_t b = (size_t)((val - lo) * scale);
+                    if (b >= (size_t)sc->n_bins) b = sc->n_bins - 1;
+                    a->hist[b]++;
+                }
+            }
+        }
+    }
+}
+
+// Summarise exact value counts into n/min/max/sum/m2 and the output histogram
+static void finish_exact(sample_acc_t *a, size_t n_values, int n_bins,
+                         double lo, double hi) {
+    size_t i;
+    a->min = R_PosInf;
+    a->max = R_NegInf;
+    for (i = 0; i < n_values; i++) {
+        double c = a->counts[i];
+        if (c == 0) continue;
+        if (i < a->min) a->min = i;
+        a->max = i;
+        a->n += c;
+        a->sum += c * i;
+    }
+    if (a->n == 0) return;
+    double mean = a->sum / a->n;
+    if (ISNAN(lo)) lo = a->min;
+    if (ISNAN(hi)) hi = a->max;
+    double scale = n_bins / (hi > lo ? hi - lo : 1);
+    for (i = (size_t)a->min; i <= (size_t)a->max; i++) {
+        double c = a->counts[i];
+        if (c == 0) continue;
+        a->m2 += c * (i - mean) * (i - mean);
+        if (i >= lo && i <= hi) {
+            size_t b = (size_t)((i - lo) * scale);
+            if (b >= (size_t)n_bins) b = n_bins - 1;
+            a->hist[b] += c;
+        }
+    }
+}
+
+// Value of 0-based rank `r` among the counted samples. Exact counts hold one
+// value per bin; fine bins are interpolated across their width.
+static double value_at_rank(const double *counts, size_t n_counts, double r,
+                            bool exact, double flo, double fw) {
+    double cum = 0;
+    for (size_t i = 0; i < n_counts; i++) {
+        if (counts[i] == 0) continue;
+        if (cum + counts[i] > r) {
+            if (exact) return (double)i;
+            return flo + fw * (i + (r - cum + 0.5) / counts[i]);
+        }
+        cum += counts[i];
+    }
+    return NA_REAL;
+}
+
+// Type 7 quantile, as in `stats::quantile()`
+static double quantile_from_counts(const sample_acc_t *a, size_t n_counts,
+                                   double p, bool exact, double flo, double fw) {
+    if (a->n == 0) return NA_REAL;
+    double h = (a->n - 1) * p, lo = floor(h);
+    double v_lo = value_at_rank(a->counts, n_counts, lo, exact, flo, fw);
+    if (h == lo) return v_lo;
+    double v_hi = value_at_rank(a->counts, n_counts, lo + 1, exact, flo, fw);
+    return v_lo + (h - lo) * (v_hi - v_lo);
+}
+
+SEXP frame_stats_C(SEXP sFn, SEXP sDirs, SEXP sNBins, SEXP sProbs,
+                   SEXP sRange) {
+    check_type_sizes();
+    int to_unprotect = 0;
+    int n_bins = asInteger(sNBins);
+    int n_probs = LENGTH(sProbs);
+    double *probs = REAL(sProbs);
+    double lo = NA_REAL, hi = NA_REAL;
+    if (n_bins < 1) Rf_error("`n_bins` must be at least 1");
+    if (sRange != R_NilValue) {
+        lo = REAL(sRange)[0];
+        hi = REAL(sRange)[1];
+    }
+    SEXP ptr = PROTECT(open_handle(sFn, "r"));
+    to_unprotect++;
+    tif_handle_t *h = get_handle(ptr);
+
+    // First collect one result row per (directory, sample) in a pairlist
+    SEXP rows = R_NilValue, rows_tail = R_NilValue;
+    PROTECT_INDEX rows_ipx;
+    PROTECT_WITH_INDEX(rows, &rows_ipx);
+    to_unprotect++;
+    R_xlen_t n_rows = 0;
+    sample_acc_t *acc = NULL;
+    double *fine_lo = NULL, *fine_w = NULL;
+    uint16_t acc_cap = 0;
+    size_t counts_cap = 0;
+
+    int *sDirs_intptr = INTEGER(sDirs);
+    int sDirs_len = LENGTH(sDirs);
+    for (int d = 0; d != sDirs_len; ++d) {  // only visit desired directories
+        int cur_dir = sDirs_intptr[d];
+        if (!handle_seek_dir(h, cur_dir)) break;
+        frame_info_t info;
+        char problem[256];
+        get_frame_info(h->tiff, &info);
+        drop_colormap(&info);  // summarise palette indices, as read_tif() does
+        if (frame_info_problem(&info, problem, sizeof(problem))) {
+            close_handle(ptr);
+            Rf_error("%s", problem);
+        }
+        bool exact = !info.is_float && info.sformat != SAMPLEFORMAT_INT &&
+            info.bps <= 16;
+        size_t n_counts = exact ? ((size_t)1 << info.bps) : N_FINE_BINS;
+        uint16_t spp = info.spp;
+        if (spp > acc_cap || n_counts > counts_cap) {  // grow, else reuse
+            acc_cap = spp > acc_cap ? spp : acc_cap;
+            counts_cap = n_counts > counts_cap ? n_counts : counts_cap;
+            acc = (sample_acc_t*) R_alloc(acc_cap, sizeof(sample_acc_t));
+            fine_lo = (double*) R_alloc(acc_cap, sizeof(double));
+            fine_w = (double*) R_alloc(acc_cap, sizeof(double));
+            for (uint16_t s = 0; s < acc_cap; s++) {
+                acc[s].counts = (double*) R_alloc(counts_cap, sizeof(double));
+                acc[s].hist = (double*) R_alloc(n_bins, sizeof(double));
+            }
+        }
+        for (uint16_t s = 0; s < spp; s++) {
+            sample_acc_t *a = acc + s;
+            a->n = a->n_na = a->sum = a->m2 = 0;
+            a->min = R_PosInf;
+            a->max = R_NegInf;
+            memset(a->counts, 0, n_counts * sizeof(double));
+            memset(a->hist, 0, n_bins * sizeof(double));
+        }
+        stats_ctx_t sc = {acc, exact, 1, n_bins, lo, hi, fine_lo, fine_w};
+        decode_frame(h->tiff, &info, &h->scratch, stats_visit, &sc);
+        if (exact) {
+            for (uint16_t s = 0; s < spp; s++) {
+                finish_exact(acc + s, n_counts, n_bins, lo, hi);
+            }
+        } else {  // second pass to bin now that min and max are known
+            bool any = false;
+            for (uint16_t s = 0; s < spp; s++) {
+                fine_lo[s] = acc[s].min;
+                fine_w[s] = (acc[s].max - acc[s].min) / N_FINE_BINS;
+                if (!(fine_w[s] > 0)) fine_w[s] = 1;
+                any = any || acc[s].n > 0;
+            }
+            sc.pass = 2;
+            if (any) decode_frame(h->tiff, &info, &h->scratch, stats_visit, &sc);
+        }
+        for (uint16_t s = 0; s < spp; s++) {
+            sample_acc_t *a = acc + s;
+            SEXP row = PROTECT(allocVector(REALSXP, N_STAT_COLS + n_probs +
+                                                    2 * n_bins + 1));
+            double *r = REAL(row);
+            bool empty = a->n == 0;
+            double b_lo = ISNAN(lo) ? a->min : lo;
+            double b_hi = ISNAN(hi) ? a->max : hi;
+            if (!(b_hi > b_lo)) b_hi = b_lo + 1;
+            r[0] = cur_dir;
+            r[1] = s + 1;
+            r[2] = a->n;
+            r[3] = a->n_na;
+            r[4] = empty ? NA_REAL : a->min;
+            r[5] = empty ? NA_REAL : a->max;
+            r[6] = empty ? NA_REAL : a->sum / a->n;
+            r[7] = a->n > 1 ? sqrt(a->m2 / (a->n - 1)) : NA_REAL;
+            for (int p = 0; p < n_probs; p++) {
+                r[N_STAT_COLS + p] = quantile_from_counts(
+                    a, n_counts, probs[p], exact, fine_lo[s], fine_w[s]
+                );
+            }
+            double *h = r + N_STAT_COLS + n_probs;
+            memcpy(h, a->hist, n_bins * sizeof(double));
+            for (int b = 0; b <= n_bins; b++) {
+                h[n_bins + b] = empty ? NA_REAL :
+                    b_lo + (b_hi - b_lo) * b / n_bins;
+            }
+            if (rows == R_NilValue) {
+                rows = rows_tail = Rf_list1(row);
+                REPROTECT(rows, rows_ipx);
+            } else {
+                rows_tail = SETCDR(rows_tail, Rf_list1(row));
+            }
+            UNPROTECT(1);  // row is now protected as part of `rows`
+            n_rows++;
+        }
+    }
+    close_handle(ptr);
+
+    // Split the rows into stats, histogram and breaks matrices
+    int n_stat_cols = N_STAT_COLS + n_probs;
+    SEXP stats = PROTECT(allocMatrix(REALSXP, n_rows, n_stat_cols));
+    SEXP hist = PROTECT(allocMatrix(REALSXP, n_rows, n_bins));
+    SEXP breaks = PROTECT(allocMatrix(REALSXP, n_rows, n_bins + 1));
+    to_unprotect += 3;
+    R_xlen_t i = 0;
+    for (SEXP node = rows; node != R_NilValue; node = CDR(node), i++) {
+        const double *r = REAL(CAR(node));
+        for (int j = 0; j < n_stat_cols; j++) {
+            REAL(stats)[i + j * n_rows] = r[j];
+        }
+        for (int j = 0; j < n_bins; j++) {
+            REAL(hist)[i + j * n_rows] = r[n_stat_cols + j];
+        }
+        for (int j = 0; j <= n_bins; j++) {
+            REAL(breaks)[i + j * n_rows] = r[n_stat_cols + n_bins + j];
+        }
+    }
+    SEXP out = PROTECT(allocVector(VECSXP, 3));
+    to_unprotect++;
+    SET_VECTOR_ELT(out, 0, stats);
+    SET_VECTOR_ELT(out, 1, hist);
+    SET_VECTOR_ELT(out, 2, breaks);
+    SEXP out_names = PROTECT(allocVector(STRSXP, 3));
+    to_unprotect++;
+    SET_STRING_ELT(out_names, 0, mkChar("stats"));
+    SET_STRING_ELT(out_names, 1, mkChar("hist"));
+    SET_STRING_ELT(out_names, 2, mkChar("breaks"));
+    setAttrib(out, R_NamesSymbol, out_names);
+    UNPROTECT(to_unprotect);
+    return out;
+}
@@ -1,5 +1,6 @@
 #include "tags.h"
 #include "common.h"
+#include "trace.h"
 #include <Rinternals.h>
 #include <tiffio.h>
 #include <unistd.h>
@@ -79,7 +80,7 @@ SEXP read_tags_C(SEXP sFn /*FileName*/, SEXP sDirs) {
         if (is_match) {
             ++cur_sDir_index;
         } else {
-            if (TIFFReadDirectory(tiff)) {
+            if (trace_read_directory(tiff)) {
                 continue;
             } else {
                 break;  // safety net: I don't expect this line to ever be needed
@@ -98,7 +99,7 @@ SEXP read_tags_C(SEXP sFn /*FileName*/, SEXP sDirs) {
             Rf_unprotect(2);  // removing explit PROTECTion of `q` UNPROTECTing `cur_tags`
             to_unprotect -= 2;
         }
-        if (!TIFFReadDirectory(tiff))
+        if (!trace_read_directory(tiff))
             break;
     }
     // Force cleanup of any internal TIFF buffers before closing
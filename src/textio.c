@@ -0,0 +1,262 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+// A growable text buffer, flushed to `f` when it gets big
+typedef struct text_buf {
+    char *data;
+    size_t len, cap;
+    FILE *f;
+    bool failed;
+} text_buf_t;
+
+#define TEXT_FLUSH_BYTES (1 << 20)
+
+static void text_flush(text_buf_t *b) {
+    if (b->len && fwrite(b->data, 1, b->len, b->f) != b->len) b->failed = true;
+    b->len = 0;
+}
+
+// Make room for `n` more bytes; false if memory ran out
+static bool text_reserve(text_buf_t *b, size_t n) {
+    if (b->len + n <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) return false;
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+// Write the digits of `v` to `out` (which has room for 21 characters).
+// Returns the number written.
+static int format_int(char *out, int64_t v) {
+    char tmp[24];
+    int n = 0, len = 0;
+    uint64_t u = (v < 0) ? (uint64_t)(-(v + 1)) + 1 : (uint64_t)v;
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) out[len++] = '-';
+    while (n) out[len++] = tmp[--n];
+    return len;
+}
+
+// Copy the string `s` to `out` without its terminator. Returns its length.
+static inline int put_str(char *out, const char *s) {
+    size_t n = strlen(s);
+    memcpy(out, s, n);
+    return (int)n;
+}
+
+// Write `x` to `out` (which has room for 32 characters) as R would read it
+// back: whole numbers as integers and anything else in the fewest
+// significant digits (up to 17) that parse back to exactly `x`. Returns the
+// number of characters written.
+static int format_double(char *out, double x) {
+    if (ISNA(x)) return put_str(out, "NA");
+    if (ISNAN(x)) return put_str(out, "NaN");
+    if (!R_FINITE(x)) return put_str(out, (x > 0) ? "Inf" : "-Inf");
+    if (x == floor(x) && fabs(x) < 1e15) return format_int(out, (int64_t)x);
+    int n = 0;
+    for (int digits = 15; digits <= 17; digits++) {
+        n = snprintf(out, 32, "%.*g", digits, x);
+        if (strtod(out, NULL) == x) break;
+    }
+    return n;
+}
+
+// Write the `length` x `width` plane `data` (of ints or doubles) to `f` as
+// tab-separated rows. Returns false on failure.
+static bool write_txt_plane(const void *data, bool is_int, R_xlen_t length,
+                            R_xlen_t width, FILE *f) {
+    text_buf_t b = {NULL, 0, 0, f, false};
+    const double *dbl = (const double*) data;
+    const int *ints = (const int*) data;
+    for (R_xlen_t y = 0; y < length && !b.failed; y++) {
+        if (!text_reserve(&b, (size_t)width * 33 + 1)) {
+            b.failed = true;
+            break;
+        }
+        for (R_xlen_t x = 0; x < width; x++) {
+            char *out = b.data + b.len;
+            if (is_int) {
+                int v = ints[x * length + y];
+                b.len += (v == NA_INTEGER) ? put_str(out, "NA") :
+                    format_int(out, v);
+            } else {
+                b.len += format_double(out, dbl[x * length + y]);
+            }
+            b.data[b.len++] = (x + 1 < width) ? '\t' : '\n';
+        }
+        if (b.len >= TEXT_FLUSH_BYTES) text_flush(&b);
+    }
+    if (!b.failed) text_flush(&b);
+    free(b.data);
+    return !b.failed;
+}
+
+// Write each `[y, x]` plane of the array `img` (double or integer, with
+// `[y, x, ...]` dimensions) to the corresponding element of `sPaths` as
+// tab-separated text, the files in parallel where OpenMP is available.
+SEXP write_txt_img_C(SEXP img, SEXP sPaths) {
+    SEXP dim = getAttrib(img, R_DimSymbol);
+    if (TYPEOF(img) != REALSXP && TYPEOF(img) != INTSXP)
+        Rf_error("`img` must be a double or integer array");
+    if (LENGTH(dim) < 2) Rf_error("`img` must be an array");
+    R_xlen_t length = INTEGER(dim)[0], width = INTEGER(dim)[1];
+    int n = LENGTH(sPaths);
+    if ((R_xlen_t)n * length * width != XLENGTH(img))
+        Rf_error("there must be one path for each plane of `img`");
+    const char **paths = (const char**) R_alloc(n, sizeof(char*));
+    for (int i = 0; i < n; i++) {
+        paths[i] = R_ExpandFileName(CHAR(STRING_ELT(sPaths, i)));
+        // R_ExpandFileName() may reuse its buffer
+        char *copy = R_alloc(strlen(paths[i]) + 1, 1);
+        paths[i] = strcpy(copy, paths[i]);
+    }
+    bool is_int = TYPEOF(img) == INTSXP;
+    const char *data = is_int ? (const char*)INTEGER(img) :
+        (const char*)REAL(img);
+    size_t plane_bytes = (size_t)length * width *
+        (is_int ? sizeof(int) : sizeof(double));
+    int failed = -1;  // the first file that couldn't be written
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if (n > 1)
+#endif
+    for (int i = 0; i < n; i++) {
+        FILE *f = fopen(paths[i], "wb");
+        bool ok = f && write_txt_plane(data + i * plane_bytes, is_int,
+                                       length, width, f);
+        if (f && fclose(f)) ok = false;
+        if (!ok) {
+#ifdef _OPENMP
+            #pragma omp critical(write_txt_failed)
+#endif
+            if (failed < 0 || i < failed) failed = i;
+        }
+    }
+    if (failed >= 0) Rf_error("Failed to write %s", paths[failed]);
+    return R_NilValue;
+}
+
+// Is `s` (up to `end`) blank?
+static bool blank(const char *s, const char *end) {
+    for (; s < end; s++) {
+        if (*s != ' ' && *s != '\t' && *s != '\r') return false;
+    }
+    return true;
+}
+
+// Parse the tab-separated field from `s` to `end` as a number: empty and "NA"
+// are NA. Returns false if it's not a number.
+static bool parse_field(const char *s, const char *end, double *out) {
+    while (s < end && *s == ' ') s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\r')) end--;
+    size_t n = end - s;
+    if (n == 0 || (n == 2 && s[0] == 'N' && s[1] == 'A')) {
+        *out = NA_REAL;
+        return true;
+    }
+    char tmp[64];
+    if (n >= sizeof(tmp)) return false;
+    memcpy(tmp, s, n);  // strtod() needs the field to end
+    tmp[n] = '\0';
+    char *stop;
+    *out = strtod(tmp, &stop);
+    return stop == tmp + n;
+}
+
+// Read a tab-separated text file of numbers (one image row per line, blank
+// lines skipped) into a double matrix, parsing the lines in parallel where
+// OpenMP is available. If a field isn't a number, the (1-based) column of
+// the first such field is returned instead.
+SEXP read_txt_img_C(SEXP sPath) {
+    const char *path = R_ExpandFileName(CHAR(STRING_ELT(sPath, 0)));
+    // stat() rather than ftell(), whose `long` is 32 bits on Windows
+#ifdef _WIN32
+    struct _stati64 st;
+    int stat_failed = _stati64(path, &st);
+#else
+    struct stat st;
+    int stat_failed = stat(path, &st);
+#endif
+    if (stat_failed) Rf_error("Unable to open %s", path);
+    if (st.st_size < 0 || (uint64_t)st.st_size >= SIZE_MAX)
+        Rf_error("%s is too big to read", path);
+    size_t size = (size_t)st.st_size;
+    FILE *f = fopen(path, "rb");
+    if (!f) Rf_error("Unable to open %s", path);
+    char *text = R_alloc(size + 1, 1);
+    size_t got = fread(text, 1, size, f);
+    fclose(f);
+    if (got != size) Rf_error("Failed to read %s", path);
+    text[size] = '\0';
+    // find the non-blank lines
+    const char *end = text + size;
+    R_xlen_t n_lines = 0;
+    for (const char *s = text, *nl; s < end; s = nl + 1) {
+        nl = memchr(s, '\n', end - s);
+        if (!nl) nl = end;
+        n_lines += !blank(s, nl);
+    }
+    const char **starts = (const char**) R_alloc(n_lines, sizeof(char*));
+    n_lines = 0;
+    for (const char *s = text, *nl; s < end; s = nl + 1) {
+        nl = memchr(s, '\n', end - s);
+        if (!nl) nl = end;
+        if (!blank(s, nl)) starts[n_lines++] = s;
+    }
+    R_xlen_t n_cols = 0;
+    if (n_lines) {
+        const char *nl = memchr(starts[0], '\n', end - starts[0]);
+        n_cols = 1;
+        for (const char *s = starts[0]; s < (nl ? nl : end); s++) {
+            n_cols += (*s == '\t');
+        }
+    }
+    SEXP out = PROTECT(Rf_allocMatrix(REALSXP, n_lines, n_cols));
+    double *vals = REAL(out);
+    // the first field that isn't a number and the first ragged row
+    R_xlen_t bad_col = n_cols + 1, bad_row = n_lines + 1;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (n_lines > 256) \
+      reduction(min:bad_col, bad_row)
+#endif
+    for (R_xlen_t i = 0; i < n_lines; i++) {
+        const char *s = starts[i], *line_end = memchr(s, '\n', end - s);
+        if (!line_end) line_end = end;
+        R_xlen_t j = 0;
+        bool more = true;
+        while (more && j < n_cols) {
+            const char *tab = memchr(s, '\t', line_end - s);
+            if (!parse_field(s, tab ? tab : line_end, vals + i + j * n_lines)) {
+                if (j + 1 < bad_col) bad_col = j + 1;
+            }
+            j++;
+            more = tab != NULL;
+            if (more) s = tab + 1;
+        }
+        if ((j < n_cols || more) && i + 1 < bad_row) bad_row = i + 1;
+        for (; j < n_cols; j++) vals[i + j * n_lines] = NA_REAL;
+    }
+    if (bad_row <= n_lines) {
+        Rf_error("Row %td of the text file at %s has a different number of "
+                 "columns to the first row.", (ptrdiff_t)bad_row, path);
+    }
+    if (bad_col <= n_cols) {
+        UNPROTECT(1);
+        return Rf_ScalarInteger((int)bad_col);
+    }
+    UNPROTECT(1);
+    return out;
+}
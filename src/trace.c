@@ -0,0 +1,116 @@
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#include <Rinternals.h>
+
+bool trace_on = false;
+uint64_t trace_counts[N_TRACE_COUNTERS];
+uint64_t trace_ns[N_TRACE_PHASES];
+uint64_t trace_total_ns = 0;
+
+static const char *counter_names[N_TRACE_COUNTERS] = {
+    "opens", "directory_reads", "reads", "bytes_read", "seeks",
+    "strips_decoded", "tiles_decoded"
+};
+
+static const char *phase_names[N_TRACE_PHASES] = {
+    "open", "directory", "io", "decode", "convert", "tags", "assemble"
+};
+
+uint64_t trace_clock_ns(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int trace_read_directory(TIFF *tiff) {
+    trace_span_t span = trace_begin();
+    int out = TIFFReadDirectory(tiff);
+    trace_end(TRACE_DIRECTORY, span);
+    trace_count(TRACE_DIR_READS, 1);
+    return out;
+}
+
+int trace_set_directory(TIFF *tiff, tdir_t dir) {
+    trace_span_t span = trace_begin();
+    int out = TIFFSetDirectory(tiff, dir);
+    trace_end(TRACE_DIRECTORY, span);
+    trace_count(TRACE_DIR_READS, 1);
+    return out;
+}
+
+int trace_set_subdirectory(TIFF *tiff, toff_t offset) {
+    trace_span_t span = trace_begin();
+    int out = TIFFSetSubDirectory(tiff, offset);
+    trace_end(TRACE_DIRECTORY, span);
+    trace_count(TRACE_DIR_READS, 1);
+    return out;
+}
+
+// Turn tracing on or off (`sOn` NA leaves it as it is). Returns whether it
+// was on.
+SEXP trace_C(SEXP sOn) {
+    bool was_on = trace_on;
+    int on = Rf_asLogical(sOn);
+    if (on != NA_LOGICAL) trace_on = on;
+    return Rf_ScalarLogical(was_on);
+}
+
+// The counters and phase times as a list of two named doubles, optionally
+// zeroing them afterwards
+SEXP trace_stats_C(SEXP sReset) {
+    SEXP counts = PROTECT(Rf_allocVector(REALSXP, N_TRACE_COUNTERS));
+    SEXP count_names = PROTECT(Rf_allocVector(STRSXP, N_TRACE_COUNTERS));
+    for (int i = 0; i < N_TRACE_COUNTERS; i++) {
+        REAL(counts)[i] = (double)trace_counts[i];
+        SET_STRING_ELT(count_names, i, Rf_mkChar(counter_names[i]));
+    }
+    Rf_setAttrib(counts, R_NamesSymbol, count_names);
+    SEXP ns = PROTECT(Rf_allocVector(REALSXP, N_TRACE_PHASES));
+    SEXP ns_names = PROTECT(Rf_allocVector(STRSXP, N_TRACE_PHASES));
+    for (int i = 0; i < N_TRACE_PHASES; i++) {
+        REAL(ns)[i] = (double)trace_ns[i];
+        SET_STRING_ELT(ns_names, i, Rf_mkChar(phase_names[i]));
+    }
+    Rf_setAttrib(ns, R_NamesSymbol, ns_names);
+    SEXP out = PROTECT(Rf_allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(out, 0, counts);
+    SET_VECTOR_ELT(out, 1, ns);
+    if (Rf_asLogical(sReset) == TRUE) {
+        memset(trace_counts, 0, sizeof(trace_counts));
+        memset(trace_ns, 0, sizeof(trace_ns));
+        trace_total_ns = 0;
+    }
+    UNPROTECT(5);
+    return out;
+}
+
+// A span for timing R code: the clock and the total charged so far, as
+// doubles (exact for 2^53 ns, about 104 days of uptime)
+SEXP trace_begin_C(void) {
+    trace_span_t span = trace_begin();
+    SEXP out = PROTECT(Rf_allocVector(REALSXP, 2));
+    REAL(out)[0] = (double)span.start;
+    REAL(out)[1] = (double)span.total;
+    UNPROTECT(1);
+    return out;
+}
+
+// Charge the time since `sSpan` began to the phase named `sPhase`
+SEXP trace_end_C(SEXP sPhase, SEXP sSpan) {
+    const char *name = CHAR(STRING_ELT(sPhase, 0));
+    trace_span_t span = {(uint64_t)REAL(sSpan)[0], (uint64_t)REAL(sSpan)[1]};
+    for (int i = 0; i < N_TRACE_PHASES; i++) {
+        if (strcmp(name, phase_names[i]) == 0) {
+            trace_end(i, span);
+            return R_NilValue;
+        }
+    }
+    Rf_error("unknown phase '%s'", name);
+}
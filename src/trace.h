@@ -0,0 +1,71 @@
+#ifndef IJTIFF_TRACE_H
+#define IJTIFF_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Opt-in counters and phase timers, reported by ijtiff_stats(). While tracing
+// is off, each of these costs one test of `trace_on`.
+enum {
+    TRACE_OPENS, TRACE_DIR_READS, TRACE_READS, TRACE_BYTES_READ, TRACE_SEEKS,
+    TRACE_STRIPS, TRACE_TILES, N_TRACE_COUNTERS
+};
+
+// Phase times are exclusive: time spent in a phase nested in another (e.g.
+// reading from the file while decoding a strip) counts only towards the inner
+// one. TRACE_TAGS and TRACE_ASSEMBLE are timed in R.
+enum {
+    TRACE_OPEN, TRACE_DIRECTORY, TRACE_IO, TRACE_DECODE, TRACE_CONVERT,
+    TRACE_TAGS, TRACE_ASSEMBLE, N_TRACE_PHASES
+};
+
+extern bool trace_on;
+extern uint64_t trace_counts[N_TRACE_COUNTERS];
+extern uint64_t trace_ns[N_TRACE_PHASES];
+extern uint64_t trace_total_ns;  // sum of `trace_ns`, charged so far
+
+typedef struct trace_span {
+    uint64_t start, total;  // the clock and `trace_total_ns` when it began
+} trace_span_t;
+
+// Nanoseconds on a monotonic clock
+uint64_t trace_clock_ns(void);
+
+static inline void trace_count(int counter, uint64_t n) {
+    if (trace_on) trace_counts[counter] += n;
+}
+
+static inline trace_span_t trace_begin(void) {
+    trace_span_t span = {0, 0};
+    if (trace_on) {
+        span.start = trace_clock_ns();
+        span.total = trace_total_ns;
+    }
+    return span;
+}
+
+// Charge the time since `span` began to `phase`, less the time charged to
+// other phases in the meantime
+static inline void trace_end(int phase, trace_span_t span) {
+    // not if tracing was off when it began or the times were reset since
+    if (!trace_on || !span.start || trace_total_ns < span.total) return;
+    uint64_t self = trace_clock_ns() - span.start -
+        (trace_total_ns - span.total);
+    trace_ns[phase] += self;
+    trace_total_ns += self;
+}
+
+// TIFFReadDirectory(), TIFFSetDirectory() and TIFFSetSubDirectory(), counted
+// and timed
+int trace_read_directory(TIFF *tiff);
+int trace_set_directory(TIFF *tiff, tdir_t dir);
+int trace_set_subdirectory(TIFF *tiff, toff_t offset);
+
+SEXP trace_C(SEXP sOn);
+SEXP trace_stats_C(SEXP sReset);
+SEXP trace_begin_C(void);
+SEXP trace_end_C(SEXP sPhase, SEXP sSpan);
+
+#endif // IJTIFF_TRACE_H
@@ -1,7 +1,12 @@
 #include <float.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include <R.h>
 #include <Rinternals.h>
 
 #include "common.h"
@@ -13,6 +18,206 @@ SEXP float_max_C(void) {
   return out;
 }
 
+// One pass over an image (double, integer or raw) to decide how it can be
+// written. Returns `list(min, max, has_na, all_int, fits_float)`, where `min`
+// and `max` ignore NAs and `fits_float` means that every non-NA value is
+// within +/- FLT_MAX.
+SEXP scan_img_C(SEXP img) {
+  R_xlen_t n = Rf_xlength(img);
+  double mn = R_PosInf, mx = R_NegInf;
+  int has_na = 0, not_int = 0, too_big = 0;
+  if (TYPEOF(img) == REALSXP) {
+    const double *x = REAL(img);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (n > 65536) \
+      reduction(min:mn) reduction(max:mx) reduction(|:has_na, not_int, too_big)
+#endif
+    for (R_xlen_t i = 0; i < n; ++i) {
+      double v = x[i];
+      if (v != v) {  // NA or NaN
+        has_na = 1;
+        continue;
+      }
+      if (v < mn) mn = v;
+      if (v > mx) mx = v;
+      not_int |= (v != floor(v));
+      too_big |= (v > FLT_MAX || v < -FLT_MAX);
+    }
+  } else if (TYPEOF(img) == INTSXP || TYPEOF(img) == LGLSXP) {
+    const int *x = (TYPEOF(img) == INTSXP) ? INTEGER(img) : LOGICAL(img);
+    int imn = INT_MAX, imx = INT_MIN;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (n > 65536) \
+      reduction(min:imn) reduction(max:imx) reduction(|:has_na)
+#endif
+    for (R_xlen_t i = 0; i < n; ++i) {
+      int v = x[i];
+      if (v == NA_INTEGER) {
+        has_na = 1;
+        continue;
+      }
+      if (v < imn) imn = v;
+      if (v > imx) imx = v;
+    }
+    if (imn <= imx) {
+      mn = imn;
+      mx = imx;
+    }
+  } else if (TYPEOF(img) == RAWSXP) {
+    const Rbyte *x = RAW(img);
+    Rbyte rmn = 255, rmx = 0;
+    for (R_xlen_t i = 0; i < n; ++i) {
+      if (x[i] < rmn) rmn = x[i];
+      if (x[i] > rmx) rmx = x[i];
+    }
+    if (n) {
+      mn = rmn;
+      mx = rmx;
+    }
+  } else {
+    Rf_error("image must be a numeric or raw array");
+  }
+  const char *names[] = {"min", "max", "has_na", "all_int", "fits_float", ""};
+  SEXP out = PROTECT(Rf_mkNamed(VECSXP, names));
+  SET_VECTOR_ELT(out, 0, Rf_ScalarReal(mn));
+  SET_VECTOR_ELT(out, 1, Rf_ScalarReal(mx));
+  SET_VECTOR_ELT(out, 2, Rf_ScalarLogical(has_na));
+  SET_VECTOR_ELT(out, 3, Rf_ScalarLogical(!not_int));
+  SET_VECTOR_ELT(out, 4, Rf_ScalarLogical(!too_big));
+  UNPROTECT(1);
+  return out;
+}
+
+// Transpose the `nrow` x `ncol` column-major matrix `src` into `dst` a
+// `TRANSPOSE_BLOCK` x `TRANSPOSE_BLOCK` block at a time, so that the reads and
+// the writes both stay within a few cache lines, with the columns of blocks
+// shared among threads
+#define TRANSPOSE_BLOCK 64
+#ifdef _OPENMP
+#define TRANSPOSE_PARALLEL \
+  _Pragma("omp parallel for schedule(static) if (nrow * ncol > 65536)")
+#else
+#define TRANSPOSE_PARALLEL
+#endif
+#define DEFINE_TRANSPOSE(name, T)                                         \
+  static void name(const T *src, T *dst, R_xlen_t nrow, R_xlen_t ncol) {  \
+    TRANSPOSE_PARALLEL                                                    \
+    for (R_xlen_t jb = 0; jb < ncol; jb += TRANSPOSE_BLOCK) {             \
+      R_xlen_t j1 = jb + TRANSPOSE_BLOCK;                                 \
+      if (j1 > ncol) j1 = ncol;                                           \
+      for (R_xlen_t ib = 0; ib < nrow; ib += TRANSPOSE_BLOCK) {           \
+        R_xlen_t i1 = ib + TRANSPOSE_BLOCK;                               \
+        if (i1 > nrow) i1 = nrow;                                         \
+        for (R_xlen_t j = jb; j < j1; ++j) {                              \
+          for (R_xlen_t i = ib; i < i1; ++i) {                            \
+            dst[j + i * ncol] = src[i + j * nrow];                        \
+          }                                                               \
+        }                                                                 \
+      }                                                                   \
+    }                                                                     \
+  }
+DEFINE_TRANSPOSE(transpose_dbl, double)
+DEFINE_TRANSPOSE(transpose_int, int)
+DEFINE_TRANSPOSE(transpose_raw, Rbyte)
+
+// `x` (double, integer, logical or raw) as an `nrow`-row matrix, transposed.
+// The result has no attributes.
+SEXP transpose_C(SEXP x, SEXP sNrow) {
+  R_xlen_t n = Rf_xlength(x), nrow = (R_xlen_t)Rf_asReal(sNrow);
+  if (nrow < 1 || n % nrow) {
+    Rf_error("`x` doesn't have %td rows", (ptrdiff_t)nrow);
+  }
+  R_xlen_t ncol = n / nrow;
+  SEXPTYPE type = TYPEOF(x);
+  SEXP out = PROTECT(Rf_allocVector(type, n));
+  if (type == REALSXP) {
+    transpose_dbl(REAL(x), REAL(out), nrow, ncol);
+  } else if (type == INTSXP) {
+    transpose_int(INTEGER(x), INTEGER(out), nrow, ncol);
+  } else if (type == LGLSXP) {
+    transpose_int(LOGICAL(x), LOGICAL(out), nrow, ncol);
+  } else if (type == RAWSXP) {
+    transpose_raw(RAW(x), RAW(out), nrow, ncol);
+  } else {
+    Rf_error("`x` must be a numeric, logical or raw array");
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+// The same blocked transpose into doubles, dividing each element by `scale`
+// on the way. `NA_TEST(v)` says whether the element `v` is an integer `NA`.
+#define DEFINE_TRANSPOSE_SCALE(name, T, NA_TEST)                           \
+  static void name(const T *src, double *dst, R_xlen_t nrow, R_xlen_t ncol, \
+                   double scale) {                                         \
+    TRANSPOSE_PARALLEL                                                     \
+    for (R_xlen_t jb = 0; jb < ncol; jb += TRANSPOSE_BLOCK) {              \
+      R_xlen_t j1 = jb + TRANSPOSE_BLOCK;                                  \
+      if (j1 > ncol) j1 = ncol;                                            \
+      for (R_xlen_t ib = 0; ib < nrow; ib += TRANSPOSE_BLOCK) {            \
+        R_xlen_t i1 = ib + TRANSPOSE_BLOCK;                                \
+        if (i1 > nrow) i1 = nrow;                                          \
+        for (R_xlen_t j = jb; j < j1; ++j) {                               \
+          for (R_xlen_t i = ib; i < i1; ++i) {                             \
+            T v = src[i + j * nrow];                                       \
+            dst[j + i * ncol] = NA_TEST(v) ? NA_REAL : v / scale;          \
+          }                                                                \
+        }                                                                  \
+      }                                                                    \
+    }                                                                      \
+  }
+#define NEVER_NA(v) 0
+#define INT_IS_NA(v) ((v) == NA_INTEGER)
+DEFINE_TRANSPOSE_SCALE(transpose_scale_dbl, double, NEVER_NA)
+DEFINE_TRANSPOSE_SCALE(transpose_scale_int, int, INT_IS_NA)
+DEFINE_TRANSPOSE_SCALE(transpose_scale_raw, Rbyte, NEVER_NA)
+
+// Transpose each `nrow` x `ncol` plane of `x` (double, integer, logical or
+// raw), i.e. swap its first two dimensions, in one pass. With `sScale` a
+// number, the result is double with each element divided by it; otherwise
+// it's the same type as `x`. The result has no attributes.
+SEXP transpose_planes_C(SEXP x, SEXP sNrow, SEXP sNcol, SEXP sScale) {
+  R_xlen_t n = Rf_xlength(x);
+  R_xlen_t nrow = (R_xlen_t)Rf_asReal(sNrow), ncol = (R_xlen_t)Rf_asReal(sNcol);
+  R_xlen_t plane = nrow * ncol;
+  if (nrow < 0 || ncol < 0 || (plane ? n % plane : n)) {
+    Rf_error("`x` isn't made of %td x %td planes", (ptrdiff_t)nrow,
+             (ptrdiff_t)ncol);
+  }
+  R_xlen_t n_planes = plane ? n / plane : 0;
+  SEXPTYPE type = TYPEOF(x);
+  if (type != REALSXP && type != INTSXP && type != LGLSXP && type != RAWSXP) {
+    Rf_error("`x` must be a numeric, logical or raw array");
+  }
+  bool scaled = !Rf_isNull(sScale);
+  double scale = scaled ? Rf_asReal(sScale) : 1;
+  SEXP out = PROTECT(Rf_allocVector(scaled ? REALSXP : type, n));
+  for (R_xlen_t p = 0; p < n_planes; ++p) {
+    R_xlen_t off = p * plane;
+    if (scaled) {
+      double *dst = REAL(out) + off;
+      if (type == REALSXP) {
+        transpose_scale_dbl(REAL(x) + off, dst, nrow, ncol, scale);
+      } else if (type == RAWSXP) {
+        transpose_scale_raw(RAW(x) + off, dst, nrow, ncol, scale);
+      } else {
+        transpose_scale_int((type == INTSXP ? INTEGER(x) : LOGICAL(x)) + off,
+                            dst, nrow, ncol, scale);
+      }
+    } else if (type == REALSXP) {
+      transpose_dbl(REAL(x) + off, REAL(out) + off, nrow, ncol);
+    } else if (type == INTSXP) {
+      transpose_int(INTEGER(x) + off, INTEGER(out) + off, nrow, ncol);
+    } else if (type == LGLSXP) {
+      transpose_int(LOGICAL(x) + off, LOGICAL(out) + off, nrow, ncol);
+    } else {
+      transpose_raw(RAW(x) + off, RAW(out) + off, nrow, ncol);
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
 SEXP dims_C(SEXP lst) {
   const R_xlen_t sz = Rf_xlength(lst);
   SEXP dims = PROTECT(Rf_allocVector(VECSXP, sz));
@@ -26,26 +231,6 @@ SEXP dims_C(SEXP lst) {
   return dims;
 }
 
-SEXP enlist_img_C(SEXP arr4d) {  // arr4d must be a 4d array of doubles
-  SEXP d4 = PROTECT(getAttr(arr4d, "dim"));
-  int *d4_int = INTEGER(d4);
-  SEXP out = PROTECT(Rf_allocVector(VECSXP, d4_int[3]));
-  R_xlen_t sub_len = d4_int[0] * d4_int[1] * d4_int[2];
-  double *arr4d_dbl = REAL(arr4d);
-  for (R_xlen_t j = 0; j != d4_int[3]; ++j) {
-    double *start = arr4d_dbl + j * sub_len;
-    SEXP out_j = PROTECT(
-      Rf_alloc3DArray(REALSXP, d4_int[0], d4_int[1], d4_int[2])
-    );
-    double *out_j_dbl = REAL(out_j);
-    memcpy(out_j_dbl, start, sub_len * sizeof(double));
-    SET_VECTOR_ELT(out, j, out_j);
-    UNPROTECT(1);
-  }
-  UNPROTECT(2);
-  return out;
-}
-
 SEXP enlist_planes_C(SEXP arr3d) {  // arr3d must be a 3d array of doubles
   SEXP d3 = PROTECT(getAttr(arr3d, "dim"));
   int *d3_int = INTEGER(d3);
@@ -66,28 +251,111 @@ SEXP enlist_planes_C(SEXP arr3d) {  // arr3d must be a 3d array of doubles
   return out;
 }
 
+// Hash table of the rows of a palette matrix, kept between calls to
+// match_pillar_to_row_3_C() so that matching many frames against the same
+// palette only builds it once.
+static struct {
+  int *mat;  // copy of the palette that the table was built from
+  int nrow, ncol;
+  int *slots;  // palette row in each slot, -1 for empty slots
+  size_t mask;  // number of slots - 1 (a power of 2 minus 1)
+} pal_cache = {NULL, 0, 0, NULL, 0};
+
+static inline uint64_t hash_mix(uint64_t h, uint32_t v) {
+  h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 29);
+}
+
+static uint64_t hash_mat_row(const int *mat, int nrow, int ncol, int j) {
+  uint64_t h = 0;
+  for (int k = 0; k != ncol; ++k) h = hash_mix(h, (uint32_t)mat[j + k * nrow]);
+  return h;
+}
+
+static bool pal_cache_matches(const int *mat, int nrow, int ncol) {
+  return pal_cache.slots && pal_cache.nrow == nrow && pal_cache.ncol == ncol &&
+    memcmp(pal_cache.mat, mat, (size_t)nrow * ncol * sizeof(int)) == 0;
+}
+
+static void pal_cache_build(const int *mat, int nrow, int ncol) {
+  size_t n_slots = 16;
+  while (n_slots < 2 * (size_t)nrow) n_slots *= 2;
+  free(pal_cache.mat);
+  free(pal_cache.slots);
+  pal_cache.mat = (int*) malloc((size_t)nrow * ncol * sizeof(int) + 1);
+  pal_cache.slots = (int*) malloc(n_slots * sizeof(int));
+  if (!pal_cache.mat || !pal_cache.slots) {
+    free(pal_cache.mat);
+    free(pal_cache.slots);
+    pal_cache.mat = pal_cache.slots = NULL;
+    Rf_error("cannot allocate palette lookup table");
+  }
+  memcpy(pal_cache.mat, mat, (size_t)nrow * ncol * sizeof(int));
+  pal_cache.nrow = nrow;
+  pal_cache.ncol = ncol;
+  pal_cache.mask = n_slots - 1;
+  memset(pal_cache.slots, -1, n_slots * sizeof(int));
+  for (int j = 0; j != nrow; ++j) {
+    size_t slot = hash_mat_row(mat, nrow, ncol, j) & pal_cache.mask;
+    bool dup = false;
+    while (pal_cache.slots[slot] != -1 && !dup) {
+      int other = pal_cache.slots[slot];
+      dup = true;
+      for (int k = 0; k != ncol && dup; ++k) {
+        dup = mat[other + k * nrow] == mat[j + k * nrow];
+      }
+      slot = (slot + 1) & pal_cache.mask;
+    }
+    if (!dup) pal_cache.slots[slot] = j;  // duplicate rows match the first
+  }
+}
+
+// For each pixel of `arr3d`, find the (0-based) row of `mat` that is equal to
+// that pixel's pillar `arr3d[y, x, ]`, or NA if there is none.
 SEXP match_pillar_to_row_3_C(SEXP arr3d, SEXP mat) {
   SEXP d = PROTECT(getAttr(arr3d, "dim"));
   int *d_int = INTEGER(d), *mat_int = INTEGER(mat);
-  double *arr3d_dbl = REAL(arr3d);
+  int nrow = Rf_nrows(mat), ncol = Rf_ncols(mat);
+  if (d_int[2] != ncol) {
+    Rf_error("`arr3d` has %d planes but the palette has %d columns",
+             d_int[2], ncol);
+  }
+  if (!pal_cache_matches(mat_int, nrow, ncol)) {
+    pal_cache_build(mat_int, nrow, ncol);
+  }
+  const double *arr3d_dbl = REAL(arr3d);
   SEXP out = PROTECT(Rf_allocMatrix(INTSXP, d_int[0], d_int[1]));
   int *out_int = INTEGER(out);
   R_xlen_t out_len = Rf_xlength(out);
-  for (R_xlen_t i = 0; i != out_len; ++i) {
-    bool found = false;
-    R_xlen_t mat_nrow = nrows(mat);
-    for (int j = 0; j != mat_nrow; ++j) {
-      if (arr3d_dbl[i] == mat_int[j] &&
-          arr3d_dbl[i + out_len] == mat_int[j + mat_nrow] &&
-          arr3d_dbl[i + 2 * out_len] == mat_int[j + 2 * mat_nrow]) {
-        found = true;
-        out_int[i] = j;
-        break;
-      }
+  const int *pal = pal_cache.mat, *slots = pal_cache.slots;
+  size_t mask = pal_cache.mask;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) if (out_len > 65536)
+#endif
+  for (R_xlen_t i = 0; i < out_len; ++i) {
+    uint64_t h = 0;
+    int k, found = NA_INTEGER;
+    for (k = 0; k != ncol; ++k) {
+      double v = arr3d_dbl[i + k * out_len];
+      if (!(v >= INT_MIN && v <= INT_MAX) || v != (int)v) break;
+      h = hash_mix(h, (uint32_t)(int)v);
     }
-    if (!found) {  // shouldn't happen
-      out_int[i] = NA_INTEGER;
+    if (k == ncol) {  // all of the pillar is integer, so it might match a row
+      for (size_t slot = h & mask; slots[slot] != -1;
+           slot = (slot + 1) & mask) {
+        int j = slots[slot];
+        for (k = 0; k != ncol; ++k) {
+          if (arr3d_dbl[i + k * out_len] != pal[j + k * nrow]) break;
+        }
+        if (k == ncol) {
+          found = j;
+          break;
+        }
+      }
     }
+    out_int[i] = found;
   }
   UNPROTECT(2);
   return out;
@@ -3,8 +3,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <math.h>
+#include <time.h>
 
 #include "common.h"
+#include "half.h"
+#include "handle.h"
+#include "trace.h"
 
 #include <Rinternals.h>
 #include <Rversion.h>
@@ -33,10 +38,40 @@ static void set_string_tag_if_provided(TIFF *tiff, SEXP value, ttag_t tag) {
   }
 }
 
+// How the strips are compressed. `level` is NA_INTEGER for the codec default.
+typedef struct codec {
+  int compression, predictor, level;
+} codec_t;
+
+// Helper function to set the compression scheme, predictor and level
+static void set_codec_fields(TIFF *tiff, const codec_t *codec) {
+  TIFFSetField(tiff, TIFFTAG_COMPRESSION, codec->compression);
+  // these tags only exist once a codec that supports them is set
+  if (codec->predictor > PREDICTOR_NONE)
+    TIFFSetField(tiff, TIFFTAG_PREDICTOR, codec->predictor);
+  if (codec->level == NA_INTEGER) return;
+  switch (codec->compression) {
+  case COMPRESSION_ADOBE_DEFLATE:
+  case COMPRESSION_DEFLATE:
+    TIFFSetField(tiff, TIFFTAG_ZIPQUALITY, codec->level);
+    break;
+  case COMPRESSION_ZSTD:
+    TIFFSetField(tiff, TIFFTAG_ZSTD_LEVEL, codec->level);
+    break;
+  case COMPRESSION_LZMA:
+    TIFFSetField(tiff, TIFFTAG_LZMAPRESET, codec->level);
+    break;
+  case COMPRESSION_JPEG:
+    TIFFSetField(tiff, TIFFTAG_JPEGQUALITY, codec->level);
+    break;
+  }
+}
+
 // Helper function to set all required TIFF fields
 static void set_required_tiff_fields(TIFF *tiff, uint32_t width, uint32_t height, 
-                                    uint32_t planes, int bps, int compression, 
-                                    bool floats) {
+                                    uint32_t planes, int bps,
+                                    const codec_t *codec, bool floats,
+                                    uint32_t rows_per_strip) {
   TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
   TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
   TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, 1);
@@ -44,8 +79,8 @@ static void set_required_tiff_fields(TIFF *tiff, uint32_t width, uint32_t height
   TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, bps);
   TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, planes);
   TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, floats ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT);
-  TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, height);
-  TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
+  TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+  set_codec_fields(tiff, codec);
   TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
 }
 
@@ -70,41 +105,111 @@ static void set_optional_tiff_tags(TIFF *tiff, SEXP sXResolution, SEXP sYResolut
   set_string_tag_if_provided(tiff, sImageDescription, TIFFTAG_IMAGEDESCRIPTION);
 }
 
-// Helper function to copy data from R array to TIFF buffer
-static void copy_data_to_buffer(tdata_t buf, double *real_arr, uint32_t width, 
-                               uint32_t height, uint32_t planes, int bps, bool floats) {
+// Strips are written one at a time from a single buffer of about this size
+#define STRIP_TARGET_BYTES (256 * 1024)
+
+// Rows per strip giving strips of about STRIP_TARGET_BYTES. Strips that don't
+// hold the whole image get a multiple of 16 rows, as JPEG compression needs.
+static uint32_t choose_rows_per_strip(size_t row_bytes, uint32_t height) {
+  size_t rows = row_bytes ? STRIP_TARGET_BYTES / row_bytes : height;
+  if (rows >= height) return height;
+  rows = (rows / 16) * 16;
+  return rows ? (uint32_t)rows : (height < 16 ? height : 16);
+}
+
+// Read element `i` of a double, integer or raw R array as a double
+static inline double elt_as_double(SEXPTYPE type, const void *arr, size_t i) {
+  switch (type) {
+  case REALSXP: return ((const double*)arr)[i];
+  case INTSXP: {
+    int v = ((const int*)arr)[i];
+    return v == NA_INTEGER ? NA_REAL : (double)v;
+  }
+  default: return (double)((const Rbyte*)arr)[i];
+  }
+}
+
+// Interleave rows `y0` to `y0 + n_rows - 1` of the column-major `[y, x, plane]`
+// frame at `arr` (element offset `off`) into the pixel-major strip `buf`
+static void fill_strip(tdata_t buf, SEXPTYPE type, const void *arr, size_t off,
+                       uint32_t width, uint32_t height, uint32_t planes,
+                       uint32_t y0, uint32_t n_rows, int bps, bool floats) {
+  size_t plane_len = (size_t)width * height;
   uint32_t x, y, pl;
-  if (floats) {
-    float *data_float = (float*) buf;
-    for (y = 0; y < height; y++) {
-      for (x = 0; x < width; x++) {
-        for (pl = 0; pl < planes; pl++) {
-          data_float[(x + y * width) * planes + pl] =
-            (float) real_arr[y + x * height + pl * width * height];
+  for (y = 0; y < n_rows; y++) {
+    for (x = 0; x < width; x++) {
+      size_t buf_idx = ((size_t)y * width + x) * planes;
+      size_t arr_idx = off + (y0 + y) + (size_t)x * height;
+      for (pl = 0; pl < planes; pl++, buf_idx++, arr_idx += plane_len) {
+        if (type == RAWSXP && bps == 8) {  // the common case needs no conversion
+          ((uint8_t*)buf)[buf_idx] = ((const Rbyte*)arr)[arr_idx];
+          continue;
+        }
+        double val = elt_as_double(type, arr, arr_idx);
+        if (floats && bps == 16) {
+          ((uint16_t*)buf)[buf_idx] = float_to_half((float)val);
+        } else if (floats) {
+          ((float*)buf)[buf_idx] = (float)val;
+        } else if (bps == 8) {
+          ((uint8_t*)buf)[buf_idx] = (uint8_t)val;
+        } else if (bps == 16) {
+          ((uint16_t*)buf)[buf_idx] = (uint16_t)val;
+        } else if (bps == 32) {
+          ((uint32_t*)buf)[buf_idx] = (uint32_t)val;
         }
       }
     }
-  } else {
-    for (y = 0; y < height; y++) {
-      for (x = 0; x < width; x++) {
-        for (pl = 0; pl < planes; pl++) {
-          size_t buf_idx = (x + y * width) * planes + pl;
-          double val = real_arr[y + x * height + pl * width * height];
-          if (bps == 8) {
-            ((uint8_t*)buf)[buf_idx] = (uint8_t)val;
-          } else if (bps == 16) {
-            ((uint16_t*)buf)[buf_idx] = (uint16_t)val;
-          } else if (bps == 32) {
-            ((uint32_t*)buf)[buf_idx] = (uint32_t)val;
-          }
-        }
+  }
+}
+
+// How each reduced-resolution (pyramid) level is made from the one above it
+enum { PYRAMID_MEAN = 0, PYRAMID_NEAREST = 1 };
+
+// Add rows `y0` to `y0 + n_rows - 1` of the column-major `[y, x, plane]` frame
+// at `arr` (element offset `off`) to the half-size level `lvl` (a zeroed
+// column-major double array), summing 2x2 blocks or taking their top-left.
+// Called on each strip just written, while its rows are still in cache.
+static void pyramid_accumulate(double *lvl, SEXPTYPE type, const void *arr,
+                               size_t off, uint32_t width, uint32_t height,
+                               uint32_t planes, uint32_t y0, uint32_t n_rows,
+                               int method) {
+  uint32_t lvl_height = (height + 1) / 2, lvl_width = (width + 1) / 2;
+  size_t plane_len = (size_t)width * height;
+  size_t lvl_plane_len = (size_t)lvl_width * lvl_height;
+  for (uint32_t pl = 0; pl < planes; pl++) {
+    for (uint32_t x = 0; x < width; x++) {
+      if (method == PYRAMID_NEAREST && (x & 1)) continue;
+      double *dest = lvl + pl * lvl_plane_len + (size_t)(x / 2) * lvl_height;
+      size_t src = off + pl * plane_len + (size_t)x * height;
+      for (uint32_t y = y0; y < y0 + n_rows; y++) {
+        if (method == PYRAMID_NEAREST && (y & 1)) continue;
+        dest[y / 2] += elt_as_double(type, arr, src + y);
+      }
+    }
+  }
+}
+
+// Turn the sums of pyramid_accumulate() into means (rounded for integer
+// images). Edge blocks of odd-sized levels have fewer than 4 pixels.
+static void pyramid_finish(double *lvl, uint32_t width, uint32_t height,
+                           uint32_t planes, int method, bool floats) {
+  if (method == PYRAMID_NEAREST) return;
+  uint32_t lvl_height = (height + 1) / 2, lvl_width = (width + 1) / 2;
+  for (uint32_t pl = 0; pl < planes; pl++) {
+    for (uint32_t x = 0; x < lvl_width; x++) {
+      double nx = (2 * x + 1 < width) ? 2 : 1;
+      for (uint32_t y = 0; y < lvl_height; y++, lvl++) {
+        double ny = (2 * y + 1 < height) ? 2 : 1;
+        *lvl /= nx * ny;
+        if (!floats) *lvl = floor(*lvl + 0.5);
       }
     }
   }
 }
 
-SEXP write_tif_C(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sFloats,
-                SEXP sXResolution, SEXP sYResolution, SEXP sResolutionUnit,
+SEXP write_tif_C(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr,
+                SEXP sPredictor, SEXP sLevel, SEXP sFloats,
+                SEXP sPyramid, SEXP sPyramidMethod, SEXP sXResolution, SEXP sYResolution, SEXP sResolutionUnit,
                 SEXP sOrientation, SEXP sXPosition, SEXP sYPosition,
                 SEXP sCopyright, SEXP sArtist, SEXP sDocumentName, SEXP sDateTime,
                 SEXP sImageDescription) {
@@ -115,85 +220,625 @@ SEXP write_tif_C(SEXP image, SEXP where, SEXP sBPS, SEXP sCompr, SEXP sFloats,
   if (bps != 8 && bps != 16 && bps != 32)
     Rf_error("currently bits_per_sample must be 8, 16 or 32");
   
-  int compression = asInteger(sCompr);
+  codec_t codec = {asInteger(sCompr), asInteger(sPredictor),
+                   sLevel == R_NilValue ? NA_INTEGER : asInteger(sLevel)};
   bool floats = asLogical(sFloats);
+  if (floats && bps == 8)
+    Rf_error("floating point images need 16 or 32 bits per sample");
   
-  // Handle image list or single image
-  SEXP dims, img_list = 0;
-  int img_index = 0;
-  int n_img = 1;
+  // The image is a `[y, x, plane, frame]` array, written a strip at a time
+  SEXPTYPE type = TYPEOF(image);
+  if (type != REALSXP && type != INTSXP && type != RAWSXP)
+    Rf_error("image must be a numeric or raw array");
+  SEXP dims = Rf_getAttrib(image, R_DimSymbol);
+  if (dims == R_NilValue || TYPEOF(dims) != INTSXP ||
+      LENGTH(dims) < 2 || LENGTH(dims) > 4) {
+    Rf_error("image must be an array of two, three or four dimensions");
+  }
+  uint32_t height = INTEGER(dims)[0];
+  uint32_t width = INTEGER(dims)[1];
+  uint32_t planes = (LENGTH(dims) > 2) ? INTEGER(dims)[2] : 1;
+  int n_img = (LENGTH(dims) > 3) ? INTEGER(dims)[3] : 1;
+  if (n_img == 0) {
+    Rf_warning("empty image, nothing to do");
+    return R_NilValue;
+  }
+  const void *arr = (type == REALSXP) ? (const void*)REAL(image) :
+    (type == INTSXP) ? (const void*)INTEGER(image) : (const void*)RAW(image);
+  size_t row_bytes = (size_t)width * planes * (bps / 8);
+  uint32_t rows_per_strip = choose_rows_per_strip(row_bytes, height);
+  // freed by R at the end of the .Call(), even if there's an error
+  tdata_t buf = (tdata_t) R_alloc(row_bytes * rows_per_strip + 1, 1);
   
-  if (TYPEOF(image) == VECSXP) {  // if the image was specified as a list
-    if ((n_img = LENGTH(image)) == 0) {
-      Rf_warning("empty image list, nothing to do");
-      return R_NilValue;
+  // Reduced-resolution levels, written as SubIFDs of each frame. Each level
+  // is made from the one above it, the first while the frame is written.
+  int n_levels = asInteger(sPyramid), pyramid_method = asInteger(sPyramidMethod);
+  double **levels = NULL;
+  uint32_t *lvl_width = NULL, *lvl_height = NULL;
+  size_t lvl_buf_size = 0;
+  toff_t *subifd_offsets = NULL;  // filled in by libtiff
+  if (n_levels > 0) {
+    levels = (double**) R_alloc(n_levels, sizeof(double*));
+    lvl_width = (uint32_t*) R_alloc(n_levels + 1, sizeof(uint32_t));
+    lvl_height = (uint32_t*) R_alloc(n_levels + 1, sizeof(uint32_t));
+    subifd_offsets = (toff_t*) R_alloc(n_levels, sizeof(toff_t));
+    memset(subifd_offsets, 0, n_levels * sizeof(toff_t));
+    lvl_width[0] = width;
+    lvl_height[0] = height;
+    for (int l = 1; l <= n_levels; l++) {
+      lvl_width[l] = (lvl_width[l - 1] + 1) / 2;
+      lvl_height[l] = (lvl_height[l - 1] + 1) / 2;
+      levels[l - 1] = (double*) R_alloc(
+        (size_t)lvl_width[l] * lvl_height[l] * planes, sizeof(double));
+      size_t lvl_row_bytes = (size_t)lvl_width[l] * planes * (bps / 8);
+      size_t strip_bytes = lvl_row_bytes *
+        choose_rows_per_strip(lvl_row_bytes, lvl_height[l]);
+      if (strip_bytes > lvl_buf_size) lvl_buf_size = strip_bytes;
     }
-    img_list = image;
   }
+  tdata_t lvl_buf = n_levels > 0 ? (tdata_t) R_alloc(lvl_buf_size + 1, 1) : NULL;
   
-  // Open output file
-  const char *fn;
-  if (TYPEOF(where) != STRSXP || LENGTH(where) != 1)
-    Rf_error("invalid filename");
-  
-  fn = CHAR(STRING_ELT(where, 0));
+  // Open output file, unless `where` is a streaming writer from tif_open_C()
+  TIFF *tiff;
   tiff_job_t rj;
-  FILE *f = fopen(fn, "w+b");
-  if (!f) Rf_error("unable to create %s", fn);
-  rj.f = f;
-  
-  TIFF *tiff = TIFF_Open("wm", &rj);
-  if (!tiff) {
-    if (!rj.f) free(rj.data);
-    Rf_error("cannot create TIFF structure");
-  }
-  
-  // Process each image
-  while (true) {
-    // Get current image from list if applicable
-    if (img_list) image = VECTOR_ELT(img_list, img_index++);
+  bool streaming = TYPEOF(where) == EXTPTRSXP;
+  if (streaming) {
+    tiff = get_handle(where)->tiff;
+  } else {
+    const char *fn;
+    if (TYPEOF(where) != STRSXP || LENGTH(where) != 1)
+      Rf_error("invalid filename");
     
-    // Validate image
-    if (TYPEOF(image) != REALSXP && TYPEOF(image) != INTSXP)
-      Rf_error("image must be a numeric array");
+    fn = CHAR(STRING_ELT(where, 0));
+    FILE *f = fopen(fn, "w+b");
+    if (!f) Rf_error("unable to create %s", fn);
+    memset(&rj, 0, sizeof(tiff_job_t));
+    rj.f = f;
     
-    dims = Rf_getAttrib(image, R_DimSymbol);
-    if (dims == R_NilValue || TYPEOF(dims) != INTSXP ||
-        LENGTH(dims) < 2 || LENGTH(dims) > 3) {
-      Rf_error("image must be an array of two or three dimensions");
+    tiff = TIFF_Open("wm", &rj);
+    if (!tiff) {
+      if (!rj.f) free(rj.data);
+      Rf_error("cannot create TIFF structure");
     }
-    
-    // Extract image dimensions
-    uint32_t width = INTEGER(dims)[1];
-    uint32_t height = INTEGER(dims)[0];
-    uint32_t planes = 1;
-    if (LENGTH(dims) == 3) planes = INTEGER(dims)[2];
+  }
+  
+  // Process each image
+  bool dir_pending = false;  // is the last frame's directory still unwritten?
+  for (int img_index = 0; img_index != n_img; ++img_index) {
+    if (dir_pending) TIFFWriteDirectory(tiff);
+    size_t off = (size_t)img_index * width * height * planes;
     
     // Set required and optional TIFF fields
-    set_required_tiff_fields(tiff, width, height, planes, bps, compression, floats);
+    set_required_tiff_fields(tiff, width, height, planes, bps, &codec, floats,
+                             rows_per_strip);
     set_optional_tiff_tags(tiff, sXResolution, sYResolution, sResolutionUnit,
                           sOrientation, sXPosition, sYPosition, sCopyright,
                           sArtist, sDocumentName, sDateTime, sImageDescription);
+    if (n_levels > 0) {
+      TIFFSetField(tiff, TIFFTAG_SUBIFD, (uint16_t)n_levels, subifd_offsets);
+      memset(levels[0], 0,
+             (size_t)lvl_width[1] * lvl_height[1] * planes * sizeof(double));
+    }
     
-    // Allocate and fill buffer
-    tdata_t buf = _TIFFmalloc(width * height * planes * (bps / 8));
-    if (!buf) Rf_error("cannot allocate output image buffer");
-    
-    double *real_arr = REAL(image);
-    copy_data_to_buffer(buf, real_arr, width, height, planes, bps, floats);
-    
-    // Write data and clean up
-    TIFFWriteEncodedStrip(tiff, 0, buf, width * height * planes * (bps / 8));
-    _TIFFfree(buf);
+    // Fill and write the strips
+    tstrip_t strip = 0;
+    for (uint32_t y0 = 0; y0 < height; y0 += rows_per_strip, strip++) {
+      uint32_t n_rows = height - y0;
+      if (n_rows > rows_per_strip) n_rows = rows_per_strip;
+      fill_strip(buf, type, arr, off, width, height, planes, y0, n_rows, bps,
+                 floats);
+      if (TIFFWriteEncodedStrip(tiff, strip, buf, row_bytes * n_rows) < 0) {
+        if (!streaming) TIFFClose(tiff);
+        Rf_error("failed to write strip %u of frame %d", strip, img_index + 1);
+      }
+      if (n_levels > 0) {
+        pyramid_accumulate(levels[0], type, arr, off, width, height, planes,
+                           y0, n_rows, pyramid_method);
+      }
+    }
+    if (n_levels == 0) {
+      dir_pending = true;
+      continue;
+    }
     
-    // Move to next directory or exit loop
-    if (img_list && img_index < n_img) {
+    // libtiff writes the directories after a frame with TIFFTAG_SUBIFD as
+    // its SubIFDs
+    TIFFWriteDirectory(tiff);
+    for (int l = 1; l <= n_levels; l++) {
+      double *lvl = levels[l - 1];
+      pyramid_finish(lvl, lvl_width[l - 1], lvl_height[l - 1], planes,
+                     pyramid_method, floats);
+      if (l < n_levels) {
+        memset(levels[l], 0,
+               (size_t)lvl_width[l + 1] * lvl_height[l + 1] * planes * sizeof(double));
+        pyramid_accumulate(levels[l], REALSXP, lvl, 0, lvl_width[l],
+                           lvl_height[l], planes, 0, lvl_height[l],
+                           pyramid_method);
+      }
+      size_t lvl_row_bytes = (size_t)lvl_width[l] * planes * (bps / 8);
+      uint32_t lvl_rps = choose_rows_per_strip(lvl_row_bytes, lvl_height[l]);
+      set_required_tiff_fields(tiff, lvl_width[l], lvl_height[l], planes, bps,
+                               &codec, floats, lvl_rps);
+      TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+      strip = 0;
+      for (uint32_t y0 = 0; y0 < lvl_height[l]; y0 += lvl_rps, strip++) {
+        uint32_t n_rows = lvl_height[l] - y0;
+        if (n_rows > lvl_rps) n_rows = lvl_rps;
+        fill_strip(lvl_buf, REALSXP, lvl, 0, lvl_width[l], lvl_height[l],
+                   planes, y0, n_rows, bps, floats);
+        if (TIFFWriteEncodedStrip(tiff, strip, lvl_buf,
+                                  lvl_row_bytes * n_rows) < 0) {
+          if (!streaming) TIFFClose(tiff);
+          Rf_error("failed to write strip %u of pyramid level %d of frame %d",
+                   strip, l, img_index + 1);
+        }
+      }
       TIFFWriteDirectory(tiff);
-    } else {
-      break;
     }
+    dir_pending = false;
   }
   
-  TIFFClose(tiff);
+  if (streaming) {
+    // the next write starts a new directory
+    if (dir_pending) TIFFWriteDirectory(tiff);
+  } else {
+    TIFFClose(tiff);
+  }
   return ScalarInteger(n_img);
 }
+
+// One candidate codec's trial in sample_compression_C()
+typedef struct sample_job {
+  tiff_job_t rj;
+  TIFF *tiff;
+  codec_t codec;
+  const uint8_t *sample;
+  uint32_t width, sample_rows, planes, rows_per_strip;
+  int bps;
+  bool floats;
+  size_t row_bytes;
+  double bytes, seconds;  // `bytes` is NA if libtiff rejected the codec
+} sample_job_t;
+
+// Compress the sample into an in-memory TIFF, with libtiff's errors deferred
+// so that a codec it rejects is recorded as a failure rather than an error
+static SEXP sample_one_codec(void *data) {
+  sample_job_t *job = (sample_job_t*) data;
+  tiff_errors_deferred = true;
+  tiff_error_count = 0;
+  job->rj.alloc = 1 << 16;
+  job->rj.data = (char*) malloc(job->rj.alloc);
+  if (!job->rj.data) Rf_error("cannot allocate compression sample buffer");
+  job->tiff = TIFF_Open("wm", &job->rj);  // in memory, freed by TIFFClose()
+  if (!job->tiff) Rf_error("cannot create TIFF structure");
+  clock_t start = clock();
+  set_required_tiff_fields(job->tiff, job->width, job->sample_rows,
+                           job->planes, job->bps, &job->codec, job->floats,
+                           job->rows_per_strip);
+  bool ok = true;
+  uint32_t done = 0;
+  for (tstrip_t strip = 0; ok && done < job->sample_rows; strip++) {
+    uint32_t n_rows = job->sample_rows - done;
+    if (n_rows > job->rows_per_strip) n_rows = job->rows_per_strip;
+    ok = TIFFWriteEncodedStrip(job->tiff, strip,
+                               (tdata_t)(job->sample + job->row_bytes * done),
+                               job->row_bytes * n_rows) >= 0;
+    done += n_rows;
+  }
+  ok = ok && TIFFWriteDirectory(job->tiff) && !tiff_error_count;
+  job->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  job->bytes = ok ? (double)job->rj.len : NA_REAL;
+  return R_NilValue;
+}
+
+// Free the trial's TIFF (and so its buffer) however sample_one_codec() ended
+static void sample_one_codec_cleanup(void *data, Rboolean jump) {
+  sample_job_t *job = (sample_job_t*) data;
+  if (job->tiff) {
+    TIFFClose(job->tiff);
+  } else {
+    free(job->rj.data);
+  }
+  job->tiff = NULL;
+  job->rj.data = NULL;
+  tiff_errors_deferred = false;
+}
+
+// Compress a sample of up to 4 strips (spread evenly through the first frame
+// of `image`) in memory with each of the codecs in the rows of the integer
+// matrix `sCodecs` (columns compression, predictor, level). Returns the
+// compressed size and CPU time of each, for choosing a codec. Codecs that
+// libtiff rejects have `NA` size.
+SEXP sample_compression_C(SEXP image, SEXP sBPS, SEXP sFloats, SEXP sCodecs) {
+  check_type_sizes();
+  int bps = asInteger(sBPS);
+  bool floats = asLogical(sFloats);
+  SEXPTYPE type = TYPEOF(image);
+  SEXP dims = Rf_getAttrib(image, R_DimSymbol);
+  uint32_t height = INTEGER(dims)[0];
+  uint32_t width = INTEGER(dims)[1];
+  uint32_t planes = (LENGTH(dims) > 2) ? INTEGER(dims)[2] : 1;
+  const void *arr = (type == REALSXP) ? (const void*)REAL(image) :
+    (type == INTSXP) ? (const void*)INTEGER(image) : (const void*)RAW(image);
+  size_t row_bytes = (size_t)width * planes * (bps / 8);
+  uint32_t rows_per_strip = choose_rows_per_strip(row_bytes, height);
+  uint32_t n_strips = (height + rows_per_strip - 1) / rows_per_strip;
+  uint32_t sampled[4], n_sampled = 0, sample_rows = 0;
+  for (uint32_t k = 0; k < 4 && k < n_strips; k++) {  // ascending, distinct
+    uint32_t s = (uint32_t)(((uint64_t)k * n_strips) / (n_strips < 4 ? n_strips : 4));
+    if (n_sampled && s == sampled[n_sampled - 1]) continue;
+    sampled[n_sampled++] = s;
+    uint32_t n_rows = height - s * rows_per_strip;
+    sample_rows += n_rows < rows_per_strip ? n_rows : rows_per_strip;
+  }
+  tdata_t sample = (tdata_t) R_alloc(row_bytes * sample_rows + 1, 1);
+  uint32_t done = 0;
+  for (uint32_t k = 0; k < n_sampled; k++) {
+    uint32_t y0 = sampled[k] * rows_per_strip, n_rows = height - y0;
+    if (n_rows > rows_per_strip) n_rows = rows_per_strip;
+    fill_strip((uint8_t*)sample + row_bytes * done, type, arr, 0, width, height,
+               planes, y0, n_rows, bps, floats);
+    done += n_rows;
+  }
+  int n_codecs = Rf_nrows(sCodecs), *codecs = INTEGER(sCodecs);
+  const char *names[] = {"bytes", "seconds", "raw_bytes", ""};
+  SEXP out = PROTECT(Rf_mkNamed(VECSXP, names));
+  SEXP bytes = PROTECT(Rf_allocVector(REALSXP, n_codecs));
+  SEXP seconds = PROTECT(Rf_allocVector(REALSXP, n_codecs));
+  SEXP cont = PROTECT(R_MakeUnwindCont());
+  for (int i = 0; i < n_codecs; i++) {
+    sample_job_t job;
+    memset(&job, 0, sizeof(sample_job_t));
+    job.codec = (codec_t){codecs[i], codecs[i + n_codecs],
+                          codecs[i + 2 * n_codecs]};
+    job.sample = (const uint8_t*)sample;
+    job.width = width;
+    job.sample_rows = sample_rows;
+    job.planes = planes;
+    job.rows_per_strip = rows_per_strip;
+    job.bps = bps;
+    job.floats = floats;
+    job.row_bytes = row_bytes;
+    R_UnwindProtect(sample_one_codec, &job, sample_one_codec_cleanup, &job,
+                    cont);
+    REAL(seconds)[i] = job.seconds;
+    REAL(bytes)[i] = job.bytes;
+  }
+  SET_VECTOR_ELT(out, 0, bytes);
+  SET_VECTOR_ELT(out, 1, seconds);
+  SET_VECTOR_ELT(out, 2, Rf_ScalarReal((double)row_bytes * sample_rows));
+  UNPROTECT(4);
+  return out;
+}
+
+// Is the given libtiff compression scheme available?
+SEXP codec_configured_C(SEXP sCompr) {
+  return Rf_ScalarLogical(TIFFIsCODECConfigured((uint16_t)asInteger(sCompr)));
+}
+
+// Replace the ImageDescription of the first directory of the TIFF file `sFn`.
+// libtiff writes the changed directory at the end of the file and relinks it,
+// so this costs one directory, however big the file.
+SEXP tif_set_description_C(SEXP sFn, SEXP sDesc) {
+  check_type_sizes();
+  if (TYPEOF(sFn) != STRSXP || LENGTH(sFn) != 1) Rf_error("invalid filename");
+  const char *fn = CHAR(STRING_ELT(sFn, 0));
+  FILE *f = fopen(fn, "r+b");
+  if (!f) Rf_error("unable to open %s", fn);
+  tiff_job_t rj;
+  memset(&rj, 0, sizeof(tiff_job_t));
+  rj.f = f;
+  TIFF *tiff = TIFF_Open("r+m", &rj);
+  if (!tiff) {
+    fclose(f);
+    Rf_error("unable to open %s as a TIFF file", fn);
+  }
+  TIFFSetField(tiff, TIFFTAG_IMAGEDESCRIPTION, CHAR(STRING_ELT(sDesc, 0)));
+  int ok = TIFFRewriteDirectory(tiff);
+  TIFFClose(tiff);  // also closes f
+  if (!ok) Rf_error("failed to update the ImageDescription of %s", fn);
+  return R_NilValue;
+}
+
+// Copy the descriptive tags, colormap and extra samples of the current
+// directory of `in` to that of `out`
+static void copy_tags(TIFF *in, TIFF *out) {
+  static const ttag_t string_tags[] = {
+    TIFFTAG_IMAGEDESCRIPTION, TIFFTAG_SOFTWARE, TIFFTAG_DOCUMENTNAME,
+    TIFFTAG_ARTIST, TIFFTAG_COPYRIGHT, TIFFTAG_DATETIME, TIFFTAG_HOSTCOMPUTER,
+    TIFFTAG_MAKE, TIFFTAG_MODEL, TIFFTAG_PAGENAME
+  };
+  static const ttag_t float_tags[] = {
+    TIFFTAG_XRESOLUTION, TIFFTAG_YRESOLUTION, TIFFTAG_XPOSITION,
+    TIFFTAG_YPOSITION
+  };
+  static const ttag_t short_tags[] = {
+    TIFFTAG_RESOLUTIONUNIT, TIFFTAG_ORIENTATION
+  };
+  size_t i;
+  for (i = 0; i < sizeof(string_tags) / sizeof(ttag_t); i++) {
+    char *val;
+    if (TIFFGetField(in, string_tags[i], &val)) TIFFSetField(out, string_tags[i], val);
+  }
+  for (i = 0; i < sizeof(float_tags) / sizeof(ttag_t); i++) {
+    float val;
+    if (TIFFGetField(in, float_tags[i], &val)) TIFFSetField(out, float_tags[i], val);
+  }
+  for (i = 0; i < sizeof(short_tags) / sizeof(ttag_t); i++) {
+    uint16_t val;
+    if (TIFFGetField(in, short_tags[i], &val)) TIFFSetField(out, short_tags[i], val);
+  }
+  uint32_t subfile_type;
+  if (TIFFGetField(in, TIFFTAG_SUBFILETYPE, &subfile_type))
+    TIFFSetField(out, TIFFTAG_SUBFILETYPE, subfile_type);
+  uint16_t *red, *green, *blue;
+  if (TIFFGetField(in, TIFFTAG_COLORMAP, &red, &green, &blue))
+    TIFFSetField(out, TIFFTAG_COLORMAP, red, green, blue);
+  uint16_t n_extra, *extra;
+  if (TIFFGetField(in, TIFFTAG_EXTRASAMPLES, &n_extra, &extra))
+    TIFFSetField(out, TIFFTAG_EXTRASAMPLES, n_extra, extra);
+}
+
+// Copy the compressed bytes of each strip/tile of the current directory of
+// `in` to that of `out` as they are. Returns false on failure.
+static bool copy_raw_striles(TIFF *in, TIFF *out, bool tiled) {
+  uint32_t n = tiled ? TIFFNumberOfTiles(in) : TIFFNumberOfStrips(in);
+  uint64_t *counts;
+  if (!TIFFGetField(in, tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS,
+                    &counts)) {
+    return false;
+  }
+  uint64_t cap = 0;
+  for (uint32_t i = 0; i < n; i++) if (counts[i] > cap) cap = counts[i];
+  tdata_t buf = (tdata_t) R_alloc(cap + 1, 1);
+  for (uint32_t i = 0; i < n; i++) {
+    if (counts[i] == 0) continue;  // a sparse file's missing strip/tile
+    tmsize_t got = tiled ?
+      TIFFReadRawTile(in, i, buf, (tmsize_t)counts[i]) :
+      TIFFReadRawStrip(in, i, buf, (tmsize_t)counts[i]);
+    if (got < 0) return false;
+    tmsize_t put = tiled ? TIFFWriteRawTile(out, i, buf, got) :
+      TIFFWriteRawStrip(out, i, buf, got);
+    if (put < 0) return false;
+  }
+  return true;
+}
+
+// Decoded rows of one directory for tif_transcode_C(), read a band (a strip
+// or a row of tiles) at a time so that each strip/tile is decoded once
+typedef struct band_reader {
+  TIFF *tiff;
+  uint32_t width, length;
+  uint32_t band_rows;  // rows per strip or tile length
+  uint32_t n_bands;  // per plane
+  uint32_t tile_width;  // 0 for stripped images
+  size_t pixel_bytes;  // in one plane
+  uint8_t *band, *tile;
+  int64_t cur;  // the band in `band` (plane * n_bands + band), -1 if none
+} band_reader_t;
+
+static bool load_band(band_reader_t *r, uint16_t plane, uint32_t b) {
+  size_t row_bytes = (size_t)r->width * r->pixel_bytes;
+  uint32_t y0 = b * r->band_rows, rows = r->length - y0;
+  if (rows > r->band_rows) rows = r->band_rows;
+  bool ok = true;
+  trace_span_t span = trace_begin();
+  if (!r->tile_width) {
+    ok = TIFFReadEncodedStrip(r->tiff, plane * r->n_bands + b, r->band,
+                              (tsize_t) -1) >= 0;
+    trace_count(TRACE_STRIPS, 1);
+  } else {
+    size_t tile_row_bytes = (size_t)r->tile_width * r->pixel_bytes;
+    for (uint32_t x = 0; ok && x < r->width; x += r->tile_width) {
+      ttile_t t = TIFFComputeTile(r->tiff, x, y0, 0, plane);
+      ok = TIFFReadEncodedTile(r->tiff, t, r->tile, (tsize_t) -1) >= 0;
+      uint32_t cols = r->width - x;
+      if (cols > r->tile_width) cols = r->tile_width;
+      for (uint32_t y = 0; ok && y < rows; y++) {
+        memcpy(r->band + y * row_bytes + x * r->pixel_bytes,
+               r->tile + y * tile_row_bytes, cols * r->pixel_bytes);
+      }
+      trace_count(TRACE_TILES, 1);
+    }
+  }
+  trace_end(TRACE_DECODE, span);
+  r->cur = ok ? (int64_t)plane * r->n_bands + b : -1;
+  return ok;
+}
+
+// Copy `n` pixels of plane `plane` from (`x0`, `y`) on to `dst`
+static bool read_pixels(band_reader_t *r, uint16_t plane, uint32_t y,
+                        uint32_t x0, uint32_t n, uint8_t *dst) {
+  uint32_t b = y / r->band_rows;
+  if (r->cur != (int64_t)plane * r->n_bands + b && !load_band(r, plane, b))
+    return false;
+  size_t offset = ((size_t)(y - b * r->band_rows) * r->width + x0) * r->pixel_bytes;
+  memcpy(dst, r->band + offset, n * r->pixel_bytes);
+  return true;
+}
+
+// Decode the `width` x `length` region from (`x0`, `y0`) of the current
+// directory of `r` and encode it into the current directory of `out`, as
+// strips of `rows_per_strip` rows or as `tile_width` x `tile_length` tiles.
+// Returns false on failure.
+static bool transcode_region(band_reader_t *r, TIFF *out, uint16_t planes,
+                             uint32_t x0, uint32_t y0, uint32_t width,
+                             uint32_t length, uint32_t tile_width,
+                             uint32_t tile_length, uint32_t rows_per_strip) {
+  size_t pb = r->pixel_bytes, row_bytes = (size_t)width * pb;
+  if (!tile_width) {
+    uint32_t strips_per_plane = (length + rows_per_strip - 1) / rows_per_strip;
+    uint8_t *buf = (uint8_t*) R_alloc(row_bytes * rows_per_strip + 1, 1);
+    for (uint16_t p = 0; p < planes; p++) {
+      tstrip_t strip = p * strips_per_plane;
+      for (uint32_t y = 0; y < length; y += rows_per_strip, strip++) {
+        uint32_t n_rows = length - y;
+        if (n_rows > rows_per_strip) n_rows = rows_per_strip;
+        for (uint32_t i = 0; i < n_rows; i++) {
+          if (!read_pixels(r, p, y0 + y + i, x0, width, buf + i * row_bytes))
+            return false;
+        }
+        if (TIFFWriteEncodedStrip(out, strip, buf, row_bytes * n_rows) < 0)
+          return false;
+      }
+    }
+    return true;
+  }
+  // a row of tiles at a time, padding the edge tiles with zeros
+  size_t tile_row_bytes = (size_t)tile_width * pb;
+  size_t tile_bytes = tile_row_bytes * tile_length;
+  uint8_t *band = (uint8_t*) R_alloc(row_bytes * tile_length + 1, 1);
+  uint8_t *tile = (uint8_t*) R_alloc(tile_bytes + 1, 1);
+  for (uint16_t p = 0; p < planes; p++) {
+    for (uint32_t y = 0; y < length; y += tile_length) {
+      uint32_t n_rows = length - y;
+      if (n_rows > tile_length) n_rows = tile_length;
+      for (uint32_t i = 0; i < n_rows; i++) {
+        if (!read_pixels(r, p, y0 + y + i, x0, width, band + i * row_bytes))
+          return false;
+      }
+      for (uint32_t x = 0; x < width; x += tile_width) {
+        uint32_t cols = width - x;
+        if (cols > tile_width) cols = tile_width;
+        if (cols < tile_width || n_rows < tile_length) memset(tile, 0, tile_bytes);
+        for (uint32_t i = 0; i < n_rows; i++) {
+          memcpy(tile + i * tile_row_bytes, band + i * row_bytes + x * pb,
+                 cols * pb);
+        }
+        if (TIFFWriteEncodedTile(out, TIFFComputeTile(out, x, y, 0, p), tile,
+                                 tile_bytes) < 0) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Copy directories `sDirs` (1-based, in the order given) of the TIFF file open
+// for reading in the handle `sIn` to the TIFF file open for writing in `sOut`,
+// keeping their sample format and tags. `sRegion` (`c(y0, x0, length, width)`,
+// 0-based) crops them, `sCodec` (`c(compression, predictor, level)`) sets the
+// compression and `sTiles` (`c(tile_width, tile_length)`, zeros for strips)
+// the layout; `NULL` keeps each directory's own. A directory whose region,
+// compression and layout are all unchanged has its compressed strips/tiles
+// copied as they are, without decoding. Returns the numbers of directories
+// written and of those copied without decoding.
+SEXP tif_transcode_C(SEXP sIn, SEXP sOut, SEXP sDirs, SEXP sRegion,
+                     SEXP sCodec, SEXP sTiles) {
+  check_type_sizes();
+  tif_handle_t *src = get_handle(sIn);
+  TIFF *in = src->tiff, *out = get_handle(sOut)->tiff;
+  int n_dirs = LENGTH(sDirs), n_raw = 0;
+  for (int d = 0; d < n_dirs; d++) {
+    int dir = INTEGER(sDirs)[d];
+    if (!handle_seek_dir(src, dir)) Rf_error("there is no directory %d", dir);
+    const void *vmax = vmaxget();  // free this directory's buffers after it
+    frame_info_t info;
+    get_frame_info(in, &info);
+    uint16_t compression = COMPRESSION_NONE, predictor = PREDICTOR_NONE;
+    uint16_t photometric = PHOTOMETRIC_MINISBLACK;
+    TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetField(in, TIFFTAG_PREDICTOR, &predictor);
+    TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric);
+    uint32_t y0 = 0, x0 = 0, length = info.length, width = info.width;
+    if (sRegion != R_NilValue) {
+      const int *region = INTEGER(sRegion);
+      y0 = region[0];
+      x0 = region[1];
+      length = region[2];
+      width = region[3];
+      if ((uint64_t)y0 + length > info.length ||
+          (uint64_t)x0 + width > info.width) {
+        Rf_error("the region doesn't fit in directory %d, which is %u x %u",
+                 dir, info.length, info.width);
+      }
+    }
+    codec_t codec = {compression, predictor, NA_INTEGER};
+    if (sCodec != R_NilValue) {
+      codec.compression = INTEGER(sCodec)[0];
+      codec.predictor = INTEGER(sCodec)[1];
+      codec.level = INTEGER(sCodec)[2];
+    }
+    uint32_t tile_width = info.tile_width, tile_length = info.tile_length;
+    if (sTiles != R_NilValue) {
+      tile_width = INTEGER(sTiles)[0];
+      tile_length = INTEGER(sTiles)[1];
+    }
+    bool raw = length == info.length && width == info.width &&
+      codec.compression == compression && codec.predictor == predictor &&
+      codec.level == NA_INTEGER && tile_width == info.tile_width &&
+      tile_length == info.tile_length && compression != COMPRESSION_OJPEG;
+    if (!raw && info.bps % 8) {
+      Rf_error("directory %d has %d bits per sample, so it can only be copied "
+               "as it is, with no change to its region, compression or tiles",
+               dir, info.bps);
+    }
+    if (!raw && compression == COMPRESSION_JPEG &&
+        photometric == PHOTOMETRIC_YCBCR) {
+      TIFFSetField(in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+      photometric = PHOTOMETRIC_RGB;
+    }
+
+    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(out, TIFFTAG_IMAGELENGTH, length);
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, info.bps);
+    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, info.spp);
+    TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, info.sformat);
+    TIFFSetField(out, TIFFTAG_PLANARCONFIG, info.config);
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, photometric);
+    copy_tags(in, out);
+    set_codec_fields(out, &codec);
+    bool separate = info.spp > 1 && info.config == PLANARCONFIG_SEPARATE;
+    uint16_t planes = separate ? info.spp : 1;
+    size_t pixel_bytes = (size_t)(separate ? 1 : info.spp) * (info.bps / 8);
+    uint32_t rows_per_strip = info.rows_per_strip;
+    if (tile_width) {
+      TIFFSetField(out, TIFFTAG_TILEWIDTH, tile_width);
+      TIFFSetField(out, TIFFTAG_TILELENGTH, tile_length);
+    } else {
+      if (!raw) rows_per_strip = choose_rows_per_strip(width * pixel_bytes, length);
+      TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+    }
+
+    bool ok;
+    if (raw) {
+      uint32_t n_tables;
+      void *tables;
+      if (compression == COMPRESSION_JPEG &&
+          TIFFGetField(in, TIFFTAG_JPEGTABLES, &n_tables, &tables)) {
+        TIFFSetField(out, TIFFTAG_JPEGTABLES, n_tables, tables);
+      }
+      uint16_t sub_h, sub_v;
+      if (photometric == PHOTOMETRIC_YCBCR &&
+          TIFFGetField(in, TIFFTAG_YCBCRSUBSAMPLING, &sub_h, &sub_v)) {
+        TIFFSetField(out, TIFFTAG_YCBCRSUBSAMPLING, sub_h, sub_v);
+      }
+      ok = copy_raw_striles(in, out, info.tile_width > 0);
+      n_raw++;
+    } else {
+      band_reader_t r = {in, info.width, info.length, 0, 0, info.tile_width,
+                         pixel_bytes, NULL, NULL, -1};
+      r.band_rows = info.tile_width ? info.tile_length : info.rows_per_strip;
+      if (r.band_rows == 0) Rf_error("directory %d has no rows per strip", dir);
+      r.n_bands = (info.length + r.band_rows - 1) / r.band_rows;
+      size_t band_bytes = (size_t)info.width * pixel_bytes * r.band_rows;
+      if (info.tile_width) {
+        r.tile = (uint8_t*) R_alloc(TIFFTileSize(in) + 1, 1);
+      } else if ((size_t)TIFFStripSize(in) > band_bytes) {
+        band_bytes = TIFFStripSize(in);
+      }
+      r.band = (uint8_t*) R_alloc(band_bytes + 1, 1);
+      ok = transcode_region(&r, out, planes, x0, y0, width, length, tile_width,
+                            tile_length, rows_per_strip);
+    }
+    if (!ok) Rf_error("failed to copy directory %d", dir);
+    if (!TIFFWriteDirectory(out)) Rf_error("failed to write directory %d", dir);
+    vmaxset(vmax);
+  }
+  SEXP res = PROTECT(Rf_allocVector(INTSXP, 2));
+  INTEGER(res)[0] = n_dirs;
+  INTEGER(res)[1] = n_raw;
+  UNPROTECT(1);
+  return res;
+}